@@ -8,6 +8,7 @@
 #include <unistd.h>
 
 #include "configurer.h"
+#include "crc32.h"
 #include "dirmanager.h"
 #include "filetree.h"
 #include "mb.h"
@@ -20,25 +21,43 @@
 #define _CACHED_OLD_FILETREE_FILENAME "filetree.bin"
 #define _FLAG_ISSET(f, x) ((f) & (x))
 #define _CLIENT_MAX_ERROR_COUNT 16
+#define _CLIENT_RECONNECT_INTERVAL_IN_SECOND 4
+#define _CLIENT_CONNECT_ATTEMPTS 3
 
+/* A multiplexed download in progress. The expected node belongs to the server tree being synchronized */
 typedef struct
 {
-    SOCKET serverSocket;
+    uint32_t id;
+    char *partialPath;
+    char *fileSavePath;
+    const FileNode_t *expected;
+} PendingDownload_t;
+
+typedef struct
+{
+    SocketConnection_t serverConn;
     struct sockaddr_in serverInfo;
     uint32_t cachedGeneration;
+    PendingDownload_t downloads[NETWPROT_MAX_STREAMS];
 } ConnectionToServer_t;
 
 static int _CreateWorkingFolder(SynchronizationClient_t *client);
 static int _CreateConnection(SynchronizationClient_t *client, ConnectionToServer_t *conn);
+static void _ClearUpConnection(void *arg);
 static int _ClientProtocol(SynchronizationClient_t *client, ConnectionToServer_t *conn);
 static int _ClientProtocolHandshake(SynchronizationClient_t *client, ConnectionToServer_t *conn);
 static FileTree_t *_ClientProtocolFileTreeRequest(SynchronizationClient_t *client, ConnectionToServer_t *conn);
+static FileTree_t *_ClientProtocolFileTreeReceive(SynchronizationClient_t *client, ConnectionToServer_t *conn);
 static void _SetTimeout(struct timeval *tv, unsigned int seconds);
 static int _ClientProtocolUpdateLocalChange(ConnectionToServer_t *conn, const char *filename, const char *syncdir);
 static int _ClientProtocolNotifyFileDeleted(ConnectionToServer_t *conn, const char *syncdir, const char *relativePath);
 static int _ClientProtocolNotifyFileCreated(ConnectionToServer_t *conn, const char *syncdir, const char *relativePath);
 static int _ClientProtocolSyncToServer(SynchronizationClient_t *client, ConnectionToServer_t *conn, const char *filename);
-static int _ClientProtocolRequestFile(ConnectionToServer_t *conn, const char *syncdir, const char *relativePath, const char *fileSavePath);
+static int _ClientProtocolRequestFile(ConnectionToServer_t *conn, const char *syncdir, const char *relativePath, const char *fileSavePath, const FileNode_t *expected);
+static int _ClientProtocolVerifyDownload(const char *path, const FileNode_t *expected);
+static int _ClientProtocolFinishDownload(const char *partialPath, const char *fileSavePath, const FileNode_t *expected, int r, int ranged);
+static int _ClientProtocolFinishDownloads(ConnectionToServer_t *conn, size_t maxActive);
+static void _ClientProtocolDropDownloads(ConnectionToServer_t *conn);
 static int _ClientProtocolWorkingLoop(SynchronizationClient_t *client, ConnectionToServer_t *conn, unsigned int *errorCount);
 static int _ClientProtocolConnStartUp(SynchronizationClient_t *client, ConnectionToServer_t *conn);
 static int _ClientProtocolNotifyFileChanged(ConnectionToServer_t *conn, const char *syncdir, const char *relativePath);
@@ -56,11 +75,22 @@ void *ClientThreadEntry(void *arg)
     if (_CreateWorkingFolder(client))
         pthread_exit(NULL);
 
-    if (_CreateConnection(client, &conn))
-        pthread_exit(NULL);
+    /* Keep reconnecting, so interrupted downloads are resumed from their sidecar files */
+    while (1)
+    {
+        if (_CreateConnection(client, &conn) == 0)
+        {
+            /* The protocol idles in cancelable sleeps, with the connection open */
+            pthread_cleanup_push(_ClearUpConnection, &conn);
+            _ClientProtocol(client, &conn);
+            pthread_cleanup_pop(1);
+        }
+
+        SyncProtSetCancelable();
+        sleep(_CLIENT_RECONNECT_INTERVAL_IN_SECOND);
+        SyncProtUnsetCancelable();
+    }
 
-    _ClientProtocol(client, &conn);
-    socketClose(conn.serverSocket);
     pthread_exit(NULL);
     return NULL;
 }
@@ -89,32 +119,44 @@ static int _CreateWorkingFolder(SynchronizationClient_t *client)
 static int _CreateConnection(SynchronizationClient_t *client, ConnectionToServer_t *conn)
 {
     SOCKET s;
-
-    s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s == INVALID_SOCKET)
-        return 1;
+    unsigned int attempt;
 
     memset(&(conn->serverInfo), 0, sizeof(conn->serverInfo));
     (conn->serverInfo).sin_family = PF_INET;
     (conn->serverInfo).sin_addr.s_addr = inet_addr(client->remoteIP);
     (conn->serverInfo).sin_port = htons(client->remotePort);
     if ((conn->serverInfo).sin_addr.s_addr == INADDR_NONE)
-    {
-        socketClose(s);
         return 1;
-    }
 
-    if (connect(s, (struct sockaddr *)&(conn->serverInfo), sizeof(conn->serverInfo)))
+    /* A server started along with this client may not be listening yet */
+    for (attempt = 1;; attempt += 1)
     {
+        s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s == INVALID_SOCKET)
+            return 1;
+        if (connect(s, (struct sockaddr *)&(conn->serverInfo), sizeof(conn->serverInfo)) == 0)
+            break;
         socketClose(s);
-        return 1;
+        if (attempt >= _CLIENT_CONNECT_ATTEMPTS)
+            return 1;
+        sleep(1);
     }
 
-    conn->serverSocket = s;
+    NetwProtConnInit(&(conn->serverConn), s);
     conn->cachedGeneration = 0;
+    memset(conn->downloads, 0, sizeof(conn->downloads));
     return 0;
 }
 
+static void _ClearUpConnection(void *arg)
+{
+    ConnectionToServer_t *conn = (ConnectionToServer_t *)arg;
+
+    socketClose(conn->serverConn.s);
+    _ClientProtocolDropDownloads(conn);
+    NetwProtConnDeInit(&(conn->serverConn));
+}
+
 static int _ClientProtocol(SynchronizationClient_t *client, ConnectionToServer_t *conn)
 {
     unsigned int errorCount = 0;
@@ -134,31 +176,39 @@ static int _ClientProtocolHandshake(SynchronizationClient_t *client, ConnectionT
     SocketMessage_t sm;
     struct timeval tv;
     int r;
-    uint32_t mn = (uint32_t)(client->magicNumber);
-    unsigned char buf[sizeof(mn)];
+    uint32_t mn = (uint32_t)(client->magicNumber), features = NetwProtSupportedFeatures();
+    unsigned char buf[sizeof(mn) + sizeof(features)];
 
+    /* Magic number followed by the features we offer */
     NetwProtUInt32ToBuf(buf, mn);
+    NetwProtUInt32ToBuf(buf + sizeof(mn), features);
     NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_HANDSHAKE, sizeof(buf), buf);
-    r = NetwProtSendTo(conn->serverSocket, &sm);
+    r = NetwProtSendTo(&(conn->serverConn), &sm);
     if (r)
         return 1;
 
     _SetTimeout(&tv, NETWPROT_READ_TIMEOUT_IN_SECOND);
-    r = NetwProtReadFrom(conn->serverSocket, &sm, &tv);
+    r = NetwProtReadFrom(&(conn->serverConn), &sm, &tv);
     if (r)
         return 1;
 
-    if (sm.messageType != NETWPROT_SM_MESSAGE_TYPE_RESPONSE || sm.messageLength != sizeof(buf))
+    /* Servers without optional features only answer the status */
+    if (sm.messageType != NETWPROT_SM_MESSAGE_TYPE_RESPONSE || (sm.messageLength != sizeof(mn) && sm.messageLength != sizeof(buf)))
     {
         NetwProtFreeSocketMesg(&sm);
         return 1;
     }
 
     NetwProtBufToUInt32(sm.message, &mn);
+    if (sm.messageLength == sizeof(buf))
+        NetwProtBufToUInt32(sm.message + sizeof(mn), &features);
+    else
+        features = 0;
     NetwProtFreeSocketMesg(&sm);
     if (mn != NETWPROT_RESPONSE_OK)
         return 1;
 
+    NetwProtSetFeatures(&(conn->serverConn), features);
     return 0;
 }
 
@@ -176,16 +226,16 @@ static FileTree_t *_ClientProtocolFileTreeRequest(SynchronizationClient_t *clien
 
     NetwProtUInt32ToBuf(buf, mn);
     NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_FILETREE_REQUEST, sizeof(buf), buf);
-    r = NetwProtSendTo(conn->serverSocket, &sm);
+    r = NetwProtSendTo(&(conn->serverConn), &sm);
     if (r)
         return NULL;
 
     _SetTimeout(&tv, NETWPROT_READ_TIMEOUT_IN_SECOND);
-    r = NetwProtReadFrom(conn->serverSocket, &sm, &tv);
+    r = NetwProtReadFrom(&(conn->serverConn), &sm, &tv);
     if (r)
         return NULL;
 
-    if (sm.messageType != NETWPROT_SM_MESSAGE_TYPE_RESPONSE || sm.messageLength <= (sizeof(buf) << 1))
+    if (sm.messageType != NETWPROT_SM_MESSAGE_TYPE_RESPONSE || sm.messageLength < (sizeof(buf) << 1))
     {
         NetwProtFreeSocketMesg(&sm);
         return NULL;
@@ -207,6 +257,22 @@ static FileTree_t *_ClientProtocolFileTreeRequest(SynchronizationClient_t *clien
     ptr += sizeof(generation);
     sizeCount += sizeof(generation);
 
+    if (conn->serverConn.features & NETWPROT_FEATURE_FILETREE_STREAM)
+    {
+        /* The tree follows in pieces, which reuse the buffer of this response */
+        if (sm.messageLength != sizeCount)
+        {
+            NetwProtFreeSocketMesg(&sm);
+            return NULL;
+        }
+        NetwProtFreeSocketMesg(&sm);
+        ft = _ClientProtocolFileTreeReceive(client, conn);
+        if (ft == NULL)
+            return NULL;
+        conn->cachedGeneration = generation;
+        return ft;
+    }
+
     mb.size = sm.messageLength - sizeCount;
     mb.ptr = ptr;
     ft = FileTreeFromMemoryBlock(&mb, client->basePath);
@@ -221,6 +287,53 @@ static FileTree_t *_ClientProtocolFileTreeRequest(SynchronizationClient_t *clien
     return ft;
 }
 
+static FileTree_t *_ClientProtocolFileTreeReceive(SynchronizationClient_t *client, ConnectionToServer_t *conn)
+{
+    SocketMessage_t sm;
+    struct timeval tv;
+    FileTreeDecoder_t d;
+    FileTree_t *ft;
+    int r = 0;
+
+    FileTreeDecoderInit(&d, client->basePath);
+    while (1)
+    {
+        _SetTimeout(&tv, NETWPROT_READ_TIMEOUT_IN_SECOND);
+        if (NetwProtReadFrom(&(conn->serverConn), &sm, &tv))
+        {
+            r = 1;
+            break;
+        }
+
+        /* Anything else is the server giving up on the tree */
+        if (sm.messageType != NETWPROT_SM_MESSAGE_TYPE_FILETREE_DATA)
+        {
+            NetwProtFreeSocketMesg(&sm);
+            r = 1;
+            break;
+        }
+        if (sm.messageLength == 0)
+        {
+            NetwProtFreeSocketMesg(&sm);
+            break;
+        }
+
+        /* Pieces after a bad one are still read, so the connection stays usable */
+        if (r == 0 && FileTreeDecoderFeed(&d, sm.message, sm.messageLength))
+            r = 1;
+        NetwProtFreeSocketMesg(&sm);
+    }
+
+    ft = FileTreeDecoderFinish(&d);
+    if (r && ft)
+    {
+        FileTreeDeInit(ft);
+        Mfree(ft);
+        ft = NULL;
+    }
+    return ft;
+}
+
 static void _SetTimeout(struct timeval *tv, unsigned int seconds)
 {
     memset(tv, 0, sizeof(*tv));
@@ -332,14 +445,14 @@ static int _ClientProtocolNotifyFileDeleted(ConnectionToServer_t *conn, const ch
     MWriteString(&mbstr, serverPath);
     MMConcat(&out, 2, &mbg, &mbstr);
     NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_NOTIFY_FILE_DELETED, out.size, out.ptr);
-    r = NetwProtSendTo(conn->serverSocket, &sm);
+    r = NetwProtSendTo(&(conn->serverConn), &sm);
     MBfree(&mbstr);
     MBfree(&out);
     if (r)
         return 1;
 
     _SetTimeout(&tv, NETWPROT_READ_TIMEOUT_IN_SECOND);
-    r = NetwProtReadFrom(conn->serverSocket, &sm, &tv);
+    r = NetwProtReadFrom(&(conn->serverConn), &sm, &tv);
     if (r)
         return 1;
 
@@ -374,7 +487,7 @@ static int _ClientProtocolNotifyFileCreated(ConnectionToServer_t *conn, const ch
     MWriteString(&mbstr, serverPath);
     MMConcat(&out, 2, &mbg, &mbstr);
     NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_NOTIFY_FILE_CREATED, out.size, out.ptr);
-    r = NetwProtSendTo(conn->serverSocket, &sm);
+    r = NetwProtSendTo(&(conn->serverConn), &sm);
     MBfree(&mbstr);
     MBfree(&out);
     if (r)
@@ -382,7 +495,7 @@ static int _ClientProtocolNotifyFileCreated(ConnectionToServer_t *conn, const ch
 
     {
         _SetTimeout(&tv, NETWPROT_READ_TIMEOUT_IN_SECOND);
-        r = NetwProtReadFrom(conn->serverSocket, &sm, &tv);
+        r = NetwProtReadFrom(&(conn->serverConn), &sm, &tv);
         if (r)
             return 1;
         if (sm.messageType != NETWPROT_SM_MESSAGE_TYPE_RESPONSE || sm.messageLength != sizeof(buf))
@@ -396,7 +509,7 @@ static int _ClientProtocolNotifyFileCreated(ConnectionToServer_t *conn, const ch
             return 1;
     }
 
-    r = NetwProtSendFile(conn->serverSocket, relativePath);
+    r = NetwProtSendFile(&(conn->serverConn), relativePath, 0);
     if (r)
         return 1;
     else
@@ -462,20 +575,23 @@ static int _ClientProtocolSyncToServer(SynchronizationClient_t *client, Connecti
                 }
                 else if (FLAG_ISSET(diff[i]->from->flags, FILENODE_FLAG_MODIFIED))
                 {
-                    r = _ClientProtocolRequestFile(conn, client->basePath, diff[i]->to->fullName, diff[i]->to->fullName);
+                    r = _ClientProtocolRequestFile(conn, client->basePath, diff[i]->to->fullName, diff[i]->to->fullName, diff[i]->to);
                 }
             }
             else if (diff[i]->to != NULL)
             {
                 if (FLAG_ISSET(diff[i]->to->flags, FILENODE_FLAG_CREATED))
                 {
-                    r = _ClientProtocolRequestFile(conn, client->basePath, diff[i]->to->fullName, diff[i]->to->fullName);
+                    r = _ClientProtocolRequestFile(conn, client->basePath, diff[i]->to->fullName, diff[i]->to->fullName, diff[i]->to);
                 }
             }
             if (r)
                 break;
         }
     }
+    /* Collect multiplexed downloads while the server tree they are checked against is still around */
+    if (_ClientProtocolFinishDownloads(conn, 0))
+        r = 1;
     FileNodeDiffRelease(diff, diffCount);
 
     FileTreeDeInit(serverFT);
@@ -500,50 +616,209 @@ static int _ClientProtocolSyncToServer(SynchronizationClient_t *client, Connecti
     return r;
 }
 
-static int _ClientProtocolRequestFile(ConnectionToServer_t *conn, const char *syncdir, const char *relativePath, const char *fileSavePath)
+static int _ClientProtocolRequestFile(ConnectionToServer_t *conn, const char *syncdir, const char *relativePath, const char *fileSavePath, const FileNode_t *expected)
 {
+    struct stat st;
     SocketMessage_t sm;
     struct timeval tv;
-    MemoryBlock_t mbstr, mbg, out;
+    MemoryBlock_t mbstr, mbg, mbo, out;
+    PendingDownload_t *pd = NULL;
     char *serverPath;
-    int r;
-    uint32_t g = conn->cachedGeneration;
+    char *partialPath;
+    int r, ranged, multiplexed;
+    size_t i;
+    uint64_t offset = 0, total = 0;
+    uint32_t g = conn->cachedGeneration, id = 0;
     unsigned char buf[sizeof(g)];
+    unsigned char bufo[sizeof(offset)];
+
+    /* Multiplexed downloads go on in the background. Keep a bounded number of them in flight */
+    multiplexed = (conn->serverConn.features & NETWPROT_FEATURE_MULTIPLEX) ? 1 : 0;
+    if (multiplexed)
+    {
+        if (_ClientProtocolFinishDownloads(conn, NETWPROT_MAX_STREAMS - 1))
+            return 1;
+        for (i = 0; i < NETWPROT_MAX_STREAMS && conn->downloads[i].partialPath; i += 1)
+            ;
+        if (i >= NETWPROT_MAX_STREAMS)
+            return 1;
+        pd = conn->downloads + i;
+    }
+
+    /* Download into a sidecar file, and resume from whatever an interrupted attempt left there */
+    ranged = (conn->serverConn.features & NETWPROT_FEATURE_RANGED_TRANSFER) ? 1 : 0;
+    partialPath = SConcat(fileSavePath, FILETREE_PARTIAL_SUFFIX);
+    if (ranged && stat(partialPath, &st) == 0)
+    {
+        offset = (uint64_t)st.st_size;
+        if (expected && offset > (uint64_t)(expected->file.size))
+            offset = 0;
+    }
 
     NetwProtUInt32ToBuf(buf, g);
     mbg.ptr = buf;
     mbg.size = sizeof(buf);
+    NetwProtUInt64ToBuf(bufo, offset);
+    mbo.ptr = bufo;
+    mbo.size = (ranged) ? sizeof(bufo) : 0;
     serverPath = strstr(relativePath, syncdir) + strlen(syncdir);
     MWriteString(&mbstr, serverPath);
-    MMConcat(&out, 2, &mbg, &mbstr);
+    MMConcat(&out, 3, &mbg, &mbstr, &mbo);
     NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_REQUEST_FILE, out.size, out.ptr);
-    r = NetwProtSendTo(conn->serverSocket, &sm);
+    r = NetwProtSendTo(&(conn->serverConn), &sm);
     MBfree(&mbstr);
     MBfree(&out);
     if (r)
+    {
+        Mfree(partialPath);
         return 1;
+    }
 
     {
         _SetTimeout(&tv, NETWPROT_READ_TIMEOUT_IN_SECOND);
-        r = NetwProtReadFrom(conn->serverSocket, &sm, &tv);
+        r = NetwProtReadFrom(&(conn->serverConn), &sm, &tv);
         if (r)
+        {
+            Mfree(partialPath);
             return 1;
-        if (sm.messageType != NETWPROT_SM_MESSAGE_TYPE_RESPONSE || sm.messageLength != sizeof(buf))
+        }
+        if (sm.messageType != NETWPROT_SM_MESSAGE_TYPE_RESPONSE || sm.messageLength < sizeof(buf))
         {
             NetwProtFreeSocketMesg(&sm);
+            Mfree(partialPath);
             return 1;
         }
         NetwProtBufToUInt32(sm.message, &g);
+        /* A stream is announced with its ID and the file size */
+        if (g == NETWPROT_RESPONSE_OK && multiplexed && sm.messageLength == sizeof(buf) + sizeof(id) + sizeof(total))
+        {
+            NetwProtBufToUInt32(sm.message + sizeof(buf), &id);
+            NetwProtBufToUInt64(sm.message + sizeof(buf) + sizeof(id), &total);
+        }
+        else if (sm.messageLength != sizeof(buf) || (g == NETWPROT_RESPONSE_OK && multiplexed))
+        {
+            NetwProtFreeSocketMesg(&sm);
+            Mfree(partialPath);
+            return 1;
+        }
         NetwProtFreeSocketMesg(&sm);
         if (g != NETWPROT_RESPONSE_OK)
+        {
+            /* Most likely the file shrank on the server, start over next time */
+            remove(partialPath);
+            Mfree(partialPath);
+            return 1;
+        }
+    }
+
+    if (multiplexed)
+    {
+        if (NetwProtStreamRecvFile(&(conn->serverConn), id, partialPath, offset, total))
+        {
+            Mfree(partialPath);
             return 1;
+        }
+        pd->id = id;
+        pd->partialPath = partialPath;
+        pd->fileSavePath = SDup(fileSavePath);
+        pd->expected = expected;
+        return 0;
     }
 
-    r = NetwProtRecvFile(conn->serverSocket, fileSavePath, &tv);
+    r = NetwProtRecvFile(&(conn->serverConn), partialPath, offset, &tv);
+    r = _ClientProtocolFinishDownload(partialPath, fileSavePath, expected, r, ranged);
+    Mfree(partialPath);
+    return r;
+}
+
+static int _ClientProtocolFinishDownload(const char *partialPath, const char *fileSavePath, const FileNode_t *expected, int r, int ranged)
+{
+    if (r == 0)
+        r = _ClientProtocolVerifyDownload(partialPath, expected);
+    if (r == 0)
+    {
+#ifdef _WIN32
+        remove(fileSavePath);
+#endif
+        r = rename(partialPath, fileSavePath);
+    }
+    else if (!ranged || r == 2)
+        remove(partialPath);
+
+    return (r) ? 1 : 0;
+}
+
+static int _ClientProtocolFinishDownloads(ConnectionToServer_t *conn, size_t maxActive)
+{
+    PendingDownload_t *pd;
+    struct timeval tv;
+    size_t i;
+    int r = 0, state;
+
+    _SetTimeout(&tv, NETWPROT_READ_TIMEOUT_IN_SECOND);
+    if (NetwProtWaitStreams(&(conn->serverConn), maxActive, &tv))
+    {
+        _ClientProtocolDropDownloads(conn);
+        return 1;
+    }
+
+    for (i = 0; i < NETWPROT_MAX_STREAMS; i += 1)
+    {
+        pd = conn->downloads + i;
+        if (!pd->partialPath)
+            continue;
+        state = NetwProtStreamState(&(conn->serverConn), pd->id);
+        if (state == NETWPROT_STREAM_STATE_ACTIVE)
+            continue;
+
+        NetwProtStreamRelease(&(conn->serverConn), pd->id);
+        if (_ClientProtocolFinishDownload(pd->partialPath, pd->fileSavePath, pd->expected, (state == NETWPROT_STREAM_STATE_DONE) ? 0 : 1, 1))
+            r = 1;
+        Mfree(pd->partialPath);
+        Mfree(pd->fileSavePath);
+        memset(pd, 0, sizeof(*pd));
+    }
+
+    return r;
+}
+
+static void _ClientProtocolDropDownloads(ConnectionToServer_t *conn)
+{
+    PendingDownload_t *pd;
+    size_t i;
+
+    /* Their sidecar files are kept, to be resumed later */
+    for (i = 0; i < NETWPROT_MAX_STREAMS; i += 1)
+    {
+        pd = conn->downloads + i;
+        if (!pd->partialPath)
+            continue;
+        NetwProtStreamRelease(&(conn->serverConn), pd->id);
+        Mfree(pd->partialPath);
+        Mfree(pd->fileSavePath);
+        memset(pd, 0, sizeof(*pd));
+    }
+}
+
+static int _ClientProtocolVerifyDownload(const char *path, const FileNode_t *expected)
+{
+    FILE *f;
+    uint32_t crc32;
+    int r;
+
+    if (!expected || !FLAG_ISSET(expected->flags, FILENODE_FLAG_CRC_VALID))
+        return 0;
+
+    f = fopen(path, "rb");
+    if (!f)
+        return 1;
+    r = Crc32_ComputeFile(f, &crc32);
+    fclose(f);
     if (r)
         return 1;
 
-    return 0;
+    /* The file changed on the server since the sidecar was started. It cannot be resumed */
+    return (crc32 == expected->file.crc32) ? 0 : 2;
 }
 
 static int _ClientProtocolWorkingLoop(SynchronizationClient_t *client, ConnectionToServer_t *conn, unsigned int *errorCount)
@@ -648,13 +923,16 @@ static int _ClientProtocolStartupMerge(SynchronizationClient_t *client, Connecti
             {
                 if (FLAG_ISSET(diff[i]->to->flags, FILENODE_FLAG_CREATED))
                 {
-                    r = _ClientProtocolRequestFile(conn, client->basePath, diff[i]->to->fullName, diff[i]->to->fullName);
+                    r = _ClientProtocolRequestFile(conn, client->basePath, diff[i]->to->fullName, diff[i]->to->fullName, diff[i]->to);
                 }
             }
             if (r)
                 break;
         }
     }
+    /* Collect multiplexed downloads while the server tree they are checked against is still around */
+    if (_ClientProtocolFinishDownloads(conn, 0))
+        r = 1;
     FileNodeDiffRelease(diff, diffCount);
     FileTreeDeInit(serverFT);
     Mfree(serverFT);
@@ -697,7 +975,7 @@ static int _ClientProtocolNotifyFileChanged(ConnectionToServer_t *conn, const ch
     MWriteString(&mbstr, serverPath);
     MMConcat(&out, 2, &mbg, &mbstr);
     NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_NOTIFY_FILE_CHANGED, out.size, out.ptr);
-    r = NetwProtSendTo(conn->serverSocket, &sm);
+    r = NetwProtSendTo(&(conn->serverConn), &sm);
     MBfree(&mbstr);
     MBfree(&out);
     if (r)
@@ -705,7 +983,7 @@ static int _ClientProtocolNotifyFileChanged(ConnectionToServer_t *conn, const ch
 
     {
         _SetTimeout(&tv, NETWPROT_READ_TIMEOUT_IN_SECOND);
-        r = NetwProtReadFrom(conn->serverSocket, &sm, &tv);
+        r = NetwProtReadFrom(&(conn->serverConn), &sm, &tv);
         if (r)
             return 1;
         if (sm.messageType != NETWPROT_SM_MESSAGE_TYPE_RESPONSE || sm.messageLength != sizeof(buf))
@@ -719,7 +997,7 @@ static int _ClientProtocolNotifyFileChanged(ConnectionToServer_t *conn, const ch
             return g;
     }
 
-    r = NetwProtSendFile(conn->serverSocket, relativePath);
+    r = NetwProtSendFile(&(conn->serverConn), relativePath, 0);
     if (r)
         return 1;
     else
@@ -736,12 +1014,12 @@ static int _ClientProtocolKeepAlive(ConnectionToServer_t *conn)
 
     NetwProtUInt32ToBuf(buf, mn);
     NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_KEEPALIVE, sizeof(buf), buf);
-    r = NetwProtSendTo(conn->serverSocket, &sm);
+    r = NetwProtSendTo(&(conn->serverConn), &sm);
     if (r)
         return 1;
 
     _SetTimeout(&tv, NETWPROT_READ_TIMEOUT_IN_SECOND);
-    r = NetwProtReadFrom(conn->serverSocket, &sm, &tv);
+    r = NetwProtReadFrom(&(conn->serverConn), &sm, &tv);
     if (r)
         return 1;
 
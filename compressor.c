@@ -0,0 +1,329 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "compressor.h"
+#include "config.h"
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define _COMPRESSOR_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+/* The built-in codec is a byte-oriented LZ77 in the spirit of LZ4 */
+/* Each sequence is a token (literal length << 4 | match length - 4), */
+/* extended lengths, literals, a 16-bit little-endian offset and extended match length. */
+/* The last sequence carries literals only. */
+#define _FAST_HASH_LOG 12
+#define _FAST_MIN_MATCH 4
+#define _FAST_LAST_LITERALS 5
+#define _FAST_MAX_OFFSET 65535
+#define _FAST_SKIP_TRIGGER 6
+
+static size_t _FastBound(size_t n);
+static size_t _FastCompress(unsigned char *dst, size_t dstCapacity, const unsigned char *src, size_t srcLen);
+static int _FastDecompress(unsigned char *dst, size_t dstLen, const unsigned char *src, size_t srcLen);
+static int _FastPutSequence(unsigned char **op, const unsigned char *oend, const unsigned char *literals, size_t literalLen, size_t offset, size_t matchLen);
+static int _FastPutLength(unsigned char **op, const unsigned char *oend, size_t len);
+static int _FastGetLength(const unsigned char **ip, const unsigned char *iend, size_t *len);
+static uint32_t _FastRead32(const unsigned char *p);
+static uint32_t _FastHash(uint32_t v);
+static size_t _SampleCompressedSize(unsigned int codec, const unsigned char *src, size_t srcLen);
+
+int CompressorIsAvailable(unsigned int codec)
+{
+    switch (codec)
+    {
+    case COMPRESSOR_CODEC_NONE:
+    case COMPRESSOR_CODEC_FAST:
+        return 1;
+#ifdef _COMPRESSOR_WITH_ZLIB
+    case COMPRESSOR_CODEC_ZLIB:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+size_t CompressorBound(unsigned int codec, size_t n)
+{
+    switch (codec)
+    {
+    case COMPRESSOR_CODEC_NONE:
+        return n;
+    case COMPRESSOR_CODEC_FAST:
+        return _FastBound(n);
+#ifdef _COMPRESSOR_WITH_ZLIB
+    case COMPRESSOR_CODEC_ZLIB:
+        return (size_t)compressBound((uLong)n);
+#endif
+    default:
+        return 0;
+    }
+}
+
+size_t CompressorCompress(unsigned int codec, void *dst, size_t dstCapacity, const void *src, size_t srcLen)
+{
+#ifdef _COMPRESSOR_WITH_ZLIB
+    uLongf zlen;
+#endif
+
+    switch (codec)
+    {
+    case COMPRESSOR_CODEC_NONE:
+        if (srcLen > dstCapacity)
+            return 0;
+        memcpy(dst, src, srcLen);
+        return srcLen;
+    case COMPRESSOR_CODEC_FAST:
+        return _FastCompress((unsigned char *)dst, dstCapacity, (const unsigned char *)src, srcLen);
+#ifdef _COMPRESSOR_WITH_ZLIB
+    case COMPRESSOR_CODEC_ZLIB:
+        zlen = (uLongf)dstCapacity;
+        if (compress2((Bytef *)dst, &zlen, (const Bytef *)src, (uLong)srcLen, Z_BEST_SPEED) != Z_OK)
+            return 0;
+        return (size_t)zlen;
+#endif
+    default:
+        return 0;
+    }
+}
+
+int CompressorDecompress(unsigned int codec, void *dst, size_t dstLen, const void *src, size_t srcLen)
+{
+#ifdef _COMPRESSOR_WITH_ZLIB
+    uLongf zlen;
+#endif
+
+    switch (codec)
+    {
+    case COMPRESSOR_CODEC_NONE:
+        if (srcLen != dstLen)
+            return 1;
+        memcpy(dst, src, srcLen);
+        return 0;
+    case COMPRESSOR_CODEC_FAST:
+        return _FastDecompress((unsigned char *)dst, dstLen, (const unsigned char *)src, srcLen);
+#ifdef _COMPRESSOR_WITH_ZLIB
+    case COMPRESSOR_CODEC_ZLIB:
+        zlen = (uLongf)dstLen;
+        if (uncompress((Bytef *)dst, &zlen, (const Bytef *)src, (uLong)srcLen) != Z_OK)
+            return 1;
+        return ((size_t)zlen == dstLen) ? 0 : 1;
+#endif
+    default:
+        return 1;
+    }
+}
+
+int CompressorIsCompressible(unsigned int codec, const void *src, size_t srcLen)
+{
+    const unsigned char *p = (const unsigned char *)src;
+    size_t half = COMPRESSOR_SAMPLE_SIZE >> 1, sampled, compressed;
+
+    if (codec == COMPRESSOR_CODEC_NONE || !CompressorIsAvailable(codec))
+        return 0;
+
+    /* Short inputs are sampled as a whole, longer ones at the head and in the middle */
+    if (srcLen <= COMPRESSOR_SAMPLE_SIZE)
+    {
+        sampled = srcLen;
+        compressed = _SampleCompressedSize(codec, p, srcLen);
+    }
+    else
+    {
+        sampled = half << 1;
+        compressed = _SampleCompressedSize(codec, p, half);
+        compressed += _SampleCompressedSize(codec, p + (srcLen >> 1), half);
+    }
+
+    return (compressed * 100 < sampled * COMPRESSOR_SAMPLE_MAX_PERCENT) ? 1 : 0;
+}
+
+// ==========================
+// Local Function Definitions
+// ==========================
+
+static size_t _FastBound(size_t n)
+{
+    return n + (n / 255) + 16;
+}
+
+static size_t _FastCompress(unsigned char *dst, size_t dstCapacity, const unsigned char *src, size_t srcLen)
+{
+    uint32_t table[1 << _FAST_HASH_LOG];
+    unsigned char *op = dst;
+    const unsigned char *oend = dst + dstCapacity;
+    size_t ip, anchor, limit, candidate, matchLen, step;
+    uint32_t v, h;
+
+    ip = anchor = 0;
+    if (srcLen > _FAST_MIN_MATCH + _FAST_LAST_LITERALS)
+    {
+        memset(table, 0, sizeof(table));
+        limit = srcLen - _FAST_LAST_LITERALS;
+        while (ip + _FAST_MIN_MATCH <= limit)
+        {
+            v = _FastRead32(src + ip);
+            h = _FastHash(v);
+            candidate = (size_t)table[h];
+            table[h] = (uint32_t)ip;
+
+            if (candidate < ip && ip - candidate <= _FAST_MAX_OFFSET && _FastRead32(src + candidate) == v)
+            {
+                matchLen = _FAST_MIN_MATCH;
+                while (ip + matchLen < limit && src[candidate + matchLen] == src[ip + matchLen])
+                    matchLen += 1;
+
+                if (_FastPutSequence(&op, oend, src + anchor, ip - anchor, ip - candidate, matchLen))
+                    return 0;
+                ip += matchLen;
+                anchor = ip;
+            }
+            else
+            {
+                /* Move faster through data that keeps failing to match */
+                step = 1 + ((ip - anchor) >> _FAST_SKIP_TRIGGER);
+                ip += step;
+            }
+        }
+    }
+
+    if (_FastPutSequence(&op, oend, src + anchor, srcLen - anchor, 0, 0))
+        return 0;
+    return (size_t)(op - dst);
+}
+
+static int _FastDecompress(unsigned char *dst, size_t dstLen, const unsigned char *src, size_t srcLen)
+{
+    const unsigned char *ip = src, *iend = src + srcLen;
+    unsigned char *op = dst, *oend = dst + dstLen;
+    size_t literalLen, matchLen, offset;
+    unsigned int token;
+
+    while (ip < iend)
+    {
+        token = *(ip++);
+        literalLen = token >> 4;
+        if (literalLen == 15 && _FastGetLength(&ip, iend, &literalLen))
+            return 1;
+        if (literalLen > (size_t)(iend - ip) || literalLen > (size_t)(oend - op))
+            return 1;
+        memcpy(op, ip, literalLen);
+        ip += literalLen;
+        op += literalLen;
+
+        /* Last sequence */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return 1;
+        offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return 1;
+
+        matchLen = token & 0x0F;
+        if (matchLen == 15 && _FastGetLength(&ip, iend, &matchLen))
+            return 1;
+        matchLen += _FAST_MIN_MATCH;
+        if (matchLen > (size_t)(oend - op))
+            return 1;
+
+        /* Byte by byte, since the match may overlap the output */
+        while (matchLen--)
+        {
+            *op = *(op - offset);
+            op += 1;
+        }
+    }
+
+    return (op == oend) ? 0 : 1;
+}
+
+static int _FastPutSequence(unsigned char **op, const unsigned char *oend, const unsigned char *literals, size_t literalLen, size_t offset, size_t matchLen)
+{
+    unsigned char *token;
+    size_t m = (matchLen) ? (matchLen - _FAST_MIN_MATCH) : 0;
+
+    if (*op >= oend)
+        return 1;
+    token = (*op)++;
+    *token = (unsigned char)(((literalLen >= 15) ? 15 : literalLen) << 4);
+    *token |= (unsigned char)((m >= 15) ? 15 : m);
+
+    if (literalLen >= 15 && _FastPutLength(op, oend, literalLen - 15))
+        return 1;
+    if (literalLen > (size_t)(oend - *op))
+        return 1;
+    memcpy(*op, literals, literalLen);
+    *op += literalLen;
+
+    if (matchLen == 0)
+        return 0;
+
+    if (oend - *op < 2)
+        return 1;
+    (*op)[0] = (unsigned char)(offset & 0xFF);
+    (*op)[1] = (unsigned char)((offset >> 8) & 0xFF);
+    *op += 2;
+
+    if (m >= 15 && _FastPutLength(op, oend, m - 15))
+        return 1;
+    return 0;
+}
+
+static int _FastPutLength(unsigned char **op, const unsigned char *oend, size_t len)
+{
+    while (len >= 255)
+    {
+        if (*op >= oend)
+            return 1;
+        *((*op)++) = 255;
+        len -= 255;
+    }
+
+    if (*op >= oend)
+        return 1;
+    *((*op)++) = (unsigned char)len;
+    return 0;
+}
+
+static int _FastGetLength(const unsigned char **ip, const unsigned char *iend, size_t *len)
+{
+    unsigned char b;
+
+    do
+    {
+        if (*ip >= iend)
+            return 1;
+        b = *((*ip)++);
+        *len += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+static uint32_t _FastRead32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t _FastHash(uint32_t v)
+{
+    return (uint32_t)(v * 2654435761U) >> (32 - _FAST_HASH_LOG);
+}
+
+static size_t _SampleCompressedSize(unsigned int codec, const unsigned char *src, size_t srcLen)
+{
+    unsigned char buf[COMPRESSOR_SAMPLE_SIZE];
+    size_t r;
+
+    /* An output which does not even fit in the sample size is counted as incompressible */
+    r = CompressorCompress(codec, buf, srcLen, src, srcLen);
+    return (r) ? r : srcLen;
+}
@@ -0,0 +1,34 @@
+#ifndef _COMPRESSOR_H_LOADED
+#define _COMPRESSOR_H_LOADED
+
+/* size_t */
+#include <stddef.h>
+
+#define COMPRESSOR_CODEC_NONE 0
+#define COMPRESSOR_CODEC_FAST 1
+#define COMPRESSOR_CODEC_ZLIB 2
+#define COMPRESSOR_CODEC_MAX 3
+
+/* Bytes taken from the input to estimate the compression ratio */
+#define COMPRESSOR_SAMPLE_SIZE 4096
+/* Data whose sample does not shrink below this percentage is considered already compressed */
+#define COMPRESSOR_SAMPLE_MAX_PERCENT 90
+
+/* Return non-zero if the codec is built into this program */
+int CompressorIsAvailable(unsigned int codec);
+
+/* Return the maximum compressed size of n bytes of input */
+size_t CompressorBound(unsigned int codec, size_t n);
+
+/* Compress srcLen bytes from src into dst, which can hold dstCapacity bytes */
+/* Return the compressed size, or 0 if the codec fails or the output does not fit */
+size_t CompressorCompress(unsigned int codec, void *dst, size_t dstCapacity, const void *src, size_t srcLen);
+
+/* Decompress srcLen bytes from src, which must expand to exactly dstLen bytes */
+/* This function returns 0 on success. Corrupted input is rejected instead of overrunning dst */
+int CompressorDecompress(unsigned int codec, void *dst, size_t dstLen, const void *src, size_t srcLen);
+
+/* Compress a sample of the input and return non-zero if it is worth compressing the whole */
+int CompressorIsCompressible(unsigned int codec, const void *src, size_t srcLen);
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "compressor.h"
+#include "mm.h"
+
+#define _TEST_INPUT_SIZE 65536
+
+static const char *_codecNames[COMPRESSOR_CODEC_MAX] = {"none", "fast", "zlib"};
+
+static int _RoundTrip(unsigned int codec, const unsigned char *in, size_t len, size_t *compressedLen);
+
+int compressor_test(void)
+{
+    unsigned char *text, *noise, *out, *scratch;
+    size_t i, j, len, c;
+    unsigned int codec, seed = 12345;
+    int r = 0;
+
+    i = MDebug();
+    text = (unsigned char *)Mmalloc(_TEST_INPUT_SIZE);
+    noise = (unsigned char *)Mmalloc(_TEST_INPUT_SIZE);
+    for (j = 0; j < _TEST_INPUT_SIZE; j += 1)
+    {
+        text[j] = (unsigned char)("./ServerDir/folder/file.txt\n"[j % 28] + (j / 4096));
+        seed = seed * 1103515245 + 12345;
+        noise[j] = (unsigned char)(seed >> 16);
+    }
+
+    for (codec = COMPRESSOR_CODEC_FAST; codec < COMPRESSOR_CODEC_MAX; codec += 1)
+    {
+        if (!CompressorIsAvailable(codec))
+        {
+            printf("Codec \"%s\" is not built in, skipped.\n", _codecNames[codec]);
+            continue;
+        }
+
+        printf("Testing CompressorCompress() with codec \"%s\"\n", _codecNames[codec]);
+        printf("T1:\tRepetitive input, %u bytes...", (unsigned int)_TEST_INPUT_SIZE);
+        if (_RoundTrip(codec, text, _TEST_INPUT_SIZE, &c) || c * 3 > _TEST_INPUT_SIZE)
+        {
+            printf("TEST FAILED\n");
+            r = 1;
+            break;
+        }
+        printf("%u bytes, PASSED\n", (unsigned int)c);
+
+        printf("T2:\tRandom input, %u bytes...", (unsigned int)_TEST_INPUT_SIZE);
+        if (_RoundTrip(codec, noise, _TEST_INPUT_SIZE, &c))
+        {
+            printf("TEST FAILED\n");
+            r = 1;
+            break;
+        }
+        printf("%u bytes, PASSED\n", (unsigned int)c);
+
+        printf("T3:\tShort inputs...");
+        for (len = 0; len < 64; len += 1)
+            if (_RoundTrip(codec, text, len, &c))
+                break;
+        if (len != 64)
+        {
+            printf("TEST FAILED at length %u\n", (unsigned int)len);
+            r = 1;
+            break;
+        }
+        printf("PASSED\n");
+
+        printf("Testing CompressorIsCompressible()\n");
+        printf("T4:\tRepetitive = %d, Random = %d...", CompressorIsCompressible(codec, text, _TEST_INPUT_SIZE), CompressorIsCompressible(codec, noise, _TEST_INPUT_SIZE));
+        if (CompressorIsCompressible(codec, text, _TEST_INPUT_SIZE) && !CompressorIsCompressible(codec, noise, _TEST_INPUT_SIZE))
+            printf("PASSED\n");
+        else
+        {
+            printf("TEST FAILED\n");
+            r = 1;
+            break;
+        }
+
+        printf("Testing CompressorDecompress() with truncated input\n");
+        out = (unsigned char *)Mmalloc(CompressorBound(codec, _TEST_INPUT_SIZE));
+        scratch = (unsigned char *)Mmalloc(_TEST_INPUT_SIZE);
+        c = CompressorCompress(codec, out, CompressorBound(codec, _TEST_INPUT_SIZE), text, _TEST_INPUT_SIZE);
+        printf("T5:\t");
+        r = (CompressorDecompress(codec, scratch, _TEST_INPUT_SIZE, out, c - 1) == 0) ? 1 : 0;
+        Mfree(out);
+        Mfree(scratch);
+        if (r)
+        {
+            printf("Accepted...TEST FAILED\n");
+            break;
+        }
+        printf("Rejected...PASSED\n");
+    }
+
+    Mfree(text);
+    Mfree(noise);
+    if (r)
+        return r;
+
+    j = MDebug();
+    printf("Testing Memory Leaks.\n");
+    printf("T6:\tExpected = %u, Actual = %u...", (unsigned int)i, (unsigned int)j);
+    if (i == j)
+        printf("PASSED\n");
+    else
+    {
+        printf("TEST FAILED\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int _RoundTrip(unsigned int codec, const unsigned char *in, size_t len, size_t *compressedLen)
+{
+    unsigned char *c, *d;
+    size_t bound, n;
+    int r;
+
+    bound = CompressorBound(codec, len);
+    c = (unsigned char *)Mmalloc(bound);
+    d = (unsigned char *)Mmalloc(len + 1);
+    n = CompressorCompress(codec, c, bound, in, len);
+    if (n == 0)
+        r = 1;
+    else
+        r = CompressorDecompress(codec, d, len, c, n) || memcmp(in, d, len);
+
+    *compressedLen = n;
+    Mfree(c);
+    Mfree(d);
+    return r;
+}
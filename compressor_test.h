@@ -0,0 +1,6 @@
+#ifndef _COMPRESSOR_TEST_H_LOADED
+#define _COMPRESSOR_TEST_H_LOADED
+
+int compressor_test(void);
+
+#endif
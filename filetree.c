@@ -38,10 +38,19 @@
 #define _INDEX_ALL_FULLNAME 1
 #define _INDEX_ALL_NUMBER 2
 
+/* Longest node name a decoder accepts, so a corrupted length cannot make it buffer gigabytes */
+#define _STREAM_MAX_NAME_LENGTH 65536
+#define _STREAM_HEADER_LENGTH 8
+#define _STREAM_FOLDER_FIELDS_LENGTH 8
+#define _STREAM_FILE_FIELDS_LENGTH 24
+/* Saved trees are read and written through a buffer of this size */
+#define _STREAM_FILE_BUFFER_SIZE 16384
+
 static const size_t _INDEX_TABLE_LENGTHS[_INDEX_TABLES] = {_INDEX_FILE_NUMBER, _INDEX_FOLDER_NUMBER, _INDEX_ALL_NUMBER};
 
 static int _FileTreeScanRecursive(const char *fullPath, TC_t *FNs, TC_t *FNFiles, TC_t *FNFolders);
 static int _GetFileStat(const char *fullPath, int *result, FileNodeTypeFile_t *fnfile);
+static int _IsPartialFile(const char *name);
 static void _DestoryFileNode(FileNode_t *fn, void *param);
 static void _PrintFileNode(FileNode_t *fn, void *param);
 static void _FileNodeToMemoryBlock(FileNode_t *fn, MemoryBlock_t *mb);
@@ -54,6 +63,12 @@ static void _FileNodeTraverse(FileNode_t *fn, void *param, void (*traverser)(Fil
 static void _FileTreeReleaseIndex(FileTree_t *t);
 static void _FileTreeRefreshIndex(FileTree_t *t);
 static void _FileTreeDiff_SetFlag(FileNode_t *fn, void *param);
+static void _StreamLevelPush(FileTreeStreamLevel_t **levels, size_t *depth, size_t *capacity, FileNode_t **nodes, size_t len, const char *path, FileNode_t *parent);
+static size_t _FileNodeToRecord(FileNode_t *fn, unsigned char **record, size_t *recordSize);
+static int _EncoderNextRecord(FileTreeEncoder_t *e);
+static int _DecoderRecordLength(const FileTreeDecoder_t *d, const unsigned char *p, size_t avail, size_t *need);
+static int _DecoderTakeRecord(FileTreeDecoder_t *d, const unsigned char *p, size_t len);
+static int _DecoderIsComplete(const FileTreeDecoder_t *d);
 //static int _FileNodeIsVersionChanged(FileNode_t *fn);
 
 #define _INTEGER_CMP(a, b) (((a) > (b)) ? (1) : (((a) < (b)) ? (-1) : 0))
@@ -250,6 +265,147 @@ FileTree_t *FileTreeFromMemoryBlock(MemoryBlock_t *mb, const char *parentPath)
     return t;
 }
 
+void FileTreeEncoderInit(FileTreeEncoder_t *e, FileTree_t *t)
+{
+    memset(e, 0, sizeof(*e));
+    e->recordSize = 256;
+    e->record = (unsigned char *)Mmalloc(e->recordSize);
+    MWriteU64(e->record, t->baseChildrenLen);
+    e->recordLength = _STREAM_HEADER_LENGTH;
+    _StreamLevelPush(&(e->levels), &(e->depth), &(e->capacity), t->baseChildren, t->baseChildrenLen, t->basePath, NULL);
+}
+
+size_t FileTreeEncoderRead(FileTreeEncoder_t *e, void *buf, size_t len)
+{
+    unsigned char *p = (unsigned char *)buf;
+    size_t written = 0, n;
+
+    while (written < len)
+    {
+        if (e->recordPosition == e->recordLength && _EncoderNextRecord(e))
+            break;
+
+        n = e->recordLength - e->recordPosition;
+        if (n > len - written)
+            n = len - written;
+        memcpy(p + written, e->record + e->recordPosition, n);
+        e->recordPosition += n;
+        written += n;
+    }
+
+    return written;
+}
+
+void FileTreeEncoderDeInit(FileTreeEncoder_t *e)
+{
+    if (e->levels)
+        Mfree(e->levels);
+    Mfree(e->record);
+    memset(e, 0, sizeof(*e));
+}
+
+void FileTreeDecoderInit(FileTreeDecoder_t *d, const char *parentPath)
+{
+    memset(d, 0, sizeof(*d));
+    d->t = (FileTree_t *)Mmalloc(sizeof(*(d->t)));
+    memset(d->t, 0, sizeof(*(d->t)));
+    d->t->basePath = SDup(parentPath);
+}
+
+int FileTreeDecoderFeed(FileTreeDecoder_t *d, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t need, n;
+
+    while (len > 0 && !(d->failed))
+    {
+        /* Nothing may follow the last node */
+        if (_DecoderIsComplete(d))
+        {
+            d->failed = 1;
+            break;
+        }
+
+        /* Whole records are decoded in place */
+        if (d->pendingLength == 0)
+        {
+            if (_DecoderRecordLength(d, p, len, &need))
+            {
+                d->failed = 1;
+                break;
+            }
+            if (need <= len)
+            {
+                if (_DecoderTakeRecord(d, p, need))
+                    d->failed = 1;
+                p += need;
+                len -= need;
+                continue;
+            }
+        }
+
+        /* A record split across pieces is gathered until its length is known and reached */
+        if (_DecoderRecordLength(d, d->pending, d->pendingLength, &need))
+        {
+            d->failed = 1;
+            break;
+        }
+        if (need > d->pendingSize)
+        {
+            if (d->pending)
+                d->pending = (unsigned char *)Mrealloc(d->pending, need);
+            else
+                d->pending = (unsigned char *)Mmalloc(need);
+            d->pendingSize = need;
+        }
+        n = need - d->pendingLength;
+        if (n > len)
+            n = len;
+        memcpy(d->pending + d->pendingLength, p, n);
+        d->pendingLength += n;
+        p += n;
+        len -= n;
+
+        if (_DecoderRecordLength(d, d->pending, d->pendingLength, &need))
+            d->failed = 1;
+        else if (need <= d->pendingLength)
+        {
+            if (_DecoderTakeRecord(d, d->pending, need))
+                d->failed = 1;
+            d->pendingLength = 0;
+        }
+    }
+
+    return d->failed;
+}
+
+FileTree_t *FileTreeDecoderFinish(FileTreeDecoder_t *d)
+{
+    FileTree_t *t = d->t;
+    size_t i;
+
+    if (!(d->failed) && d->pendingLength == 0 && _DecoderIsComplete(d))
+        _FileTreeConstructAfterLoadingFromMemoryBlock(t);
+    else
+    {
+        /* Only the nodes decoded so far are released */
+        for (i = d->depth; i > 1; i -= 1)
+            d->levels[i - 1].parent->folder.childrenLen = d->levels[i - 1].next;
+        if (d->depth > 0)
+            t->baseChildrenLen = d->levels[0].next;
+        FileTreeDeInit(t);
+        Mfree(t);
+        t = NULL;
+    }
+
+    if (d->levels)
+        Mfree(d->levels);
+    if (d->pending)
+        Mfree(d->pending);
+    memset(d, 0, sizeof(*d));
+    return t;
+}
+
 int FileTreeComputeCRC32(FileTree_t *t)
 {
     FILE *f;
@@ -476,65 +632,54 @@ void FileNodeDiffDebugPrint(FileNodeDiff_t **diff, size_t len)
 
 FileTree_t *FileTreeFromFile(const char *filename, const char *syncdir)
 {
-    struct stat s;
-    MemoryBlock_t mb;
+    FileTreeDecoder_t d;
     FileTree_t *fileFT;
-    unsigned char *buf;
+    unsigned char buf[_STREAM_FILE_BUFFER_SIZE];
     FILE *f;
-    size_t fileSize, elementsRead;
-    int r;
-
-    r = stat(filename, &s);
-    if (r)
-        return NULL;
+    size_t n;
 
     f = fopen(filename, "rb");
     if (!f)
         return NULL;
 
-    fileSize = (size_t)s.st_size;
-    buf = (unsigned char *)Mmalloc(fileSize);
-    elementsRead = fread(buf, fileSize, 1, f);
+    FileTreeDecoderInit(&d, syncdir);
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        if (FileTreeDecoderFeed(&d, buf, n))
+            break;
     fclose(f);
-    if (elementsRead != 1)
-    {
-        Mfree(buf);
-        return NULL;
-    }
 
-    mb.ptr = buf;
-    mb.size = fileSize;
-    fileFT = FileTreeFromMemoryBlock(&mb, syncdir);
+    fileFT = FileTreeDecoderFinish(&d);
     if (fileFT == NULL)
-    {
         remove(filename);
-        Mfree(buf);
-        return NULL;
-    }
-
-    Mfree(buf);
     return fileFT;
 }
 
 int FileTreeToFile(const char *filename, FileTree_t *ft)
 {
-    MemoryBlock_t mb;
+    FileTreeEncoder_t e;
+    unsigned char buf[_STREAM_FILE_BUFFER_SIZE];
     FILE *f;
-    size_t needToWrite, bytesWritten;
+    size_t n;
+    int r = 0;
 
     f = fopen(filename, "wb");
     if (!f)
         return 1;
 
-    FileTreeToMemoryblock(ft, &mb);
-    needToWrite = mb.size;
-    bytesWritten = fwrite(mb.ptr, 1, needToWrite, f);
-    MBfree(&mb);
-    fclose(f);
-    if (bytesWritten != needToWrite)
-        return 1;
-    else
-        return 0;
+    FileTreeEncoderInit(&e, ft);
+    while ((n = FileTreeEncoderRead(&e, buf, sizeof(buf))) > 0)
+    {
+        if (fwrite(buf, 1, n, f) != n)
+        {
+            r = 1;
+            break;
+        }
+    }
+    FileTreeEncoderDeInit(&e);
+
+    if (fclose(f))
+        r = 1;
+    return r;
 }
 
 // ============================
@@ -575,6 +720,8 @@ static int _FileTreeScanRecursive(const char *fullPath, TC_t *FNs, TC_t *FNFiles
                     continue;
                 else if (strcmp(dp->d_name, "..") == 0)
                     continue;
+                else if (_IsPartialFile(dp->d_name))
+                    continue;
 
                 fileFullPath = DirManagerPathConcat(fullPath, dp->d_name);
                 if (!_GetFileStat(fileFullPath, &ft, &fnfile))
@@ -666,6 +813,13 @@ static int _GetFileStat(const char *fullPath, int *result, FileNodeTypeFile_t *f
     return 0;
 }
 
+static int _IsPartialFile(const char *name)
+{
+    size_t l = strlen(name), n = strlen(FILETREE_PARTIAL_SUFFIX);
+
+    return (l > n && strcmp(name + l - n, FILETREE_PARTIAL_SUFFIX) == 0) ? 1 : 0;
+}
+
 static void _DestoryFileNode(FileNode_t *fn, void *param)
 {
     size_t i;
@@ -1066,3 +1220,193 @@ static void _FileTreeDiff_SetFlag(FileNode_t *fn, void *param)
 {
     return (FLAG_ISSET(fn->flags, FILENODE_FLAG_CREATED) || FLAG_ISSET(fn->flags, FILENODE_FLAG_DELETED) || FLAG_ISSET(fn->flags, FILENODE_FLAG_MODIFIED) || FLAG_ISSET(fn->flags, FILENODE_FLAG_MOVED_FROM) || FLAG_ISSET(fn->flags, FILENODE_FLAG_MOVED_TO)) ? (1) : (0);
 }*/
+
+static void _StreamLevelPush(FileTreeStreamLevel_t **levels, size_t *depth, size_t *capacity, FileNode_t **nodes, size_t len, const char *path, FileNode_t *parent)
+{
+    FileTreeStreamLevel_t *level;
+
+    if (*depth == *capacity)
+    {
+        if (*levels)
+        {
+            *capacity <<= 1;
+            *levels = (FileTreeStreamLevel_t *)Mrealloc(*levels, sizeof(**levels) * (*capacity));
+        }
+        else
+        {
+            *capacity = 16;
+            *levels = (FileTreeStreamLevel_t *)Mmalloc(sizeof(**levels) * (*capacity));
+        }
+    }
+
+    level = (*levels) + (*depth);
+    level->nodes = nodes;
+    level->len = len;
+    level->next = 0;
+    level->path = path;
+    level->parent = parent;
+    *depth += 1;
+}
+
+static size_t _FileNodeToRecord(FileNode_t *fn, unsigned char **record, size_t *recordSize)
+{
+    unsigned char *p;
+    size_t l, n;
+
+    /* Same layout as _FileNodeToMemoryBlock(), without the children */
+    l = strlen(fn->nodeName);
+    n = sizeof(uint32_t) + l + sizeof(uint32_t) + _STREAM_FILE_FIELDS_LENGTH;
+    if (n > *recordSize)
+    {
+        *record = (unsigned char *)Mrealloc(*record, n);
+        *recordSize = n;
+    }
+
+    p = *record;
+    MWriteU32(p, (uint32_t)l);
+    p += sizeof(uint32_t);
+    memcpy(p, fn->nodeName, l);
+    p += l;
+    MWriteU32(p, fn->flags);
+    p += sizeof(uint32_t);
+
+    if (FLAG_ISSET(fn->flags, FILENODE_FLAG_IS_DIR))
+    {
+        MWriteU64(p, fn->folder.childrenLen);
+        p += sizeof(uint64_t);
+    }
+    else
+    {
+        MWriteU64(p, fn->file.size);
+        p += sizeof(uint64_t);
+        MWriteU64(p, fn->file.timeLastModification);
+        p += sizeof(uint64_t);
+        MWriteU32(p, fn->file.crc32);
+        p += sizeof(uint32_t);
+        MWriteU32(p, fn->file.version);
+        p += sizeof(uint32_t);
+    }
+
+    return (size_t)(p - *record);
+}
+
+static int _EncoderNextRecord(FileTreeEncoder_t *e)
+{
+    FileTreeStreamLevel_t *level;
+    FileNode_t *fn;
+
+    while (e->depth > 0 && e->levels[e->depth - 1].next == e->levels[e->depth - 1].len)
+        e->depth -= 1;
+    if (e->depth == 0)
+        return 1;
+
+    level = e->levels + (e->depth - 1);
+    fn = level->nodes[level->next];
+    level->next += 1;
+
+    e->recordLength = _FileNodeToRecord(fn, &(e->record), &(e->recordSize));
+    e->recordPosition = 0;
+    if (FLAG_ISSET(fn->flags, FILENODE_FLAG_IS_DIR) && fn->folder.childrenLen > 0)
+        _StreamLevelPush(&(e->levels), &(e->depth), &(e->capacity), fn->folder.children, fn->folder.childrenLen, NULL, fn);
+
+    return 0;
+}
+
+static int _DecoderRecordLength(const FileTreeDecoder_t *d, const unsigned char *p, size_t avail, size_t *need)
+{
+    void *ptr;
+    size_t l;
+    uint32_t flags;
+
+    /* The count of base nodes comes first */
+    if (d->depth == 0)
+    {
+        *need = _STREAM_HEADER_LENGTH;
+        return 0;
+    }
+
+    *need = sizeof(uint32_t);
+    if (avail < *need)
+        return 0;
+    ptr = (void *)p;
+    l = (size_t)MReadU32(&ptr);
+    if (l > _STREAM_MAX_NAME_LENGTH)
+        return 1;
+
+    *need += l + sizeof(uint32_t);
+    if (avail < *need)
+        return 0;
+    ptr = (void *)(p + sizeof(uint32_t) + l);
+    flags = MReadU32(&ptr);
+
+    *need += (FLAG_ISSET(flags, FILENODE_FLAG_IS_DIR)) ? _STREAM_FOLDER_FIELDS_LENGTH : _STREAM_FILE_FIELDS_LENGTH;
+    return 0;
+}
+
+static int _DecoderTakeRecord(FileTreeDecoder_t *d, const unsigned char *p, size_t len)
+{
+    FileTreeStreamLevel_t *level;
+    FileNode_t *fn;
+    uint64_t countU64;
+    void *ptr = (void *)p;
+    char *node;
+
+    if (d->depth == 0)
+    {
+        countU64 = MReadU64(&ptr);
+        if (countU64 > SIZE_MAX / sizeof(FileNode_t *))
+            return 1;
+        d->t->baseChildrenLen = (size_t)countU64;
+        d->t->baseChildren = (FileNode_t **)Mmalloc(sizeof(*(d->t->baseChildren)) * d->t->baseChildrenLen);
+        _StreamLevelPush(&(d->levels), &(d->depth), &(d->capacity), d->t->baseChildren, d->t->baseChildrenLen, d->t->basePath, NULL);
+        return 0;
+    }
+
+    node = MReadString(&ptr, &len);
+    if (node == NULL)
+        return 1;
+
+    level = d->levels + (d->depth - 1);
+    fn = (FileNode_t *)Mmalloc(sizeof(*fn));
+    fn->nodeName = node;
+    fn->fullName = DirManagerPathConcat(level->path, node);
+    fn->parent = level->parent;
+    fn->flags = (unsigned int)MReadU32(&ptr);
+
+    if (FLAG_ISSET(fn->flags, FILENODE_FLAG_IS_DIR))
+    {
+        countU64 = MReadU64(&ptr);
+        if (countU64 > SIZE_MAX / sizeof(FileNode_t *))
+        {
+            Mfree(fn->nodeName);
+            Mfree(fn->fullName);
+            Mfree(fn);
+            return 1;
+        }
+        fn->folder.childrenLen = (size_t)countU64;
+        fn->folder.children = (FileNode_t **)Mmalloc(sizeof(*(fn->folder.children)) * fn->folder.childrenLen);
+    }
+    else
+    {
+        fn->file.size = (size_t)MReadU64(&ptr);
+        fn->file.timeLastModification = (time_t)MReadU64(&ptr);
+        fn->file.crc32 = MReadU32(&ptr);
+        fn->file.version = MReadU32(&ptr);
+    }
+
+    level->nodes[level->next] = fn;
+    level->next += 1;
+
+    /* Descend into a non-empty folder, climb back out of every finished one */
+    if (FLAG_ISSET(fn->flags, FILENODE_FLAG_IS_DIR) && fn->folder.childrenLen > 0)
+        _StreamLevelPush(&(d->levels), &(d->depth), &(d->capacity), fn->folder.children, fn->folder.childrenLen, fn->fullName, fn);
+    while (d->depth > 1 && d->levels[d->depth - 1].next == d->levels[d->depth - 1].len)
+        d->depth -= 1;
+
+    return 0;
+}
+
+static int _DecoderIsComplete(const FileTreeDecoder_t *d)
+{
+    return (d->depth == 1 && d->levels[0].next == d->levels[0].len) ? 1 : 0;
+}
@@ -25,6 +25,9 @@
 #define FILENODE_FLAG_MOVED_TO 0x00000040
 #define FILENODE_FLAG_VERSION_VALID 0x00000080
 
+/* Files being downloaded carry this suffix until they are complete. Scans skip them */
+#define FILETREE_PARTIAL_SUFFIX ".opensync-partial"
+
 #define FLAG_SET(f, x) ((f) |= (x))
 #define FLAG_RESET(f, x) ((f) &= (~(x)))
 #define FLAG_ISSET(f, x) ((f) & (x))
@@ -73,6 +76,43 @@ typedef struct
     FileNode_t *to;
 } FileNodeDiff_t;
 
+/* One folder being walked by an encoder or filled by a decoder */
+typedef struct
+{
+    FileNode_t **nodes;
+    size_t len;
+    size_t next;
+    const char *path;
+    FileNode_t *parent;
+} FileTreeStreamLevel_t;
+
+/* Produces the FileTreeToMemoryblock() format a piece at a time */
+typedef struct
+{
+    FileTreeStreamLevel_t *levels;
+    size_t depth;
+    size_t capacity;
+    /* The record being copied out, and how much of it is left */
+    unsigned char *record;
+    size_t recordSize;
+    size_t recordLength;
+    size_t recordPosition;
+} FileTreeEncoder_t;
+
+/* Rebuilds a tree from the FileTreeToMemoryblock() format fed in pieces of any size */
+typedef struct
+{
+    FileTree_t *t;
+    FileTreeStreamLevel_t *levels;
+    size_t depth;
+    size_t capacity;
+    /* A record split across pieces is gathered here */
+    unsigned char *pending;
+    size_t pendingSize;
+    size_t pendingLength;
+    int failed;
+} FileTreeDecoder_t;
+
 /* Initialize a file tree */
 void FileTreeInit(FileTree_t *t);
 
@@ -94,6 +134,24 @@ void FileTreeToMemoryblock(FileTree_t *t, MemoryBlock_t *mb);
 /* Memory Block to File Tree, Return NULL if invalid */
 FileTree_t *FileTreeFromMemoryBlock(MemoryBlock_t *mb, const char *parentPath);
 
+/* Start encoding a tree. The tree must not change until the encoder is released */
+void FileTreeEncoderInit(FileTreeEncoder_t *e, FileTree_t *t);
+
+/* Write up to len bytes of the encoded tree to buf. Return the bytes written, 0 once the whole tree is out */
+size_t FileTreeEncoderRead(FileTreeEncoder_t *e, void *buf, size_t len);
+
+/* Release an encoder */
+void FileTreeEncoderDeInit(FileTreeEncoder_t *e);
+
+/* Start decoding a tree whose files live under parentPath */
+void FileTreeDecoderInit(FileTreeDecoder_t *d, const char *parentPath);
+
+/* Feed the next len bytes of an encoded tree. Return non-zero once the input is found invalid */
+int FileTreeDecoderFeed(FileTreeDecoder_t *d, const void *data, size_t len);
+
+/* Release a decoder. Return the tree if it was fed completely and nothing more, NULL otherwise */
+FileTree_t *FileTreeDecoderFinish(FileTreeDecoder_t *d);
+
 /* Compute CRC32 of every files under the tree */
 int FileTreeComputeCRC32(FileTree_t *t);
 
@@ -8,7 +8,10 @@ int filetree_test(void)
 {
     FileNodeDiff_t **diff = NULL;
     MemoryBlock_t mb, mb2;
-    size_t i, j, k;
+    FileTreeEncoder_t enc;
+    FileTreeDecoder_t dec;
+    unsigned char *buf;
+    size_t i, j, k, n;
     FileTree_t t, *t2, *t3;
     FILE *f;
     int r;
@@ -257,11 +260,86 @@ int filetree_test(void)
     Mfree(t3);
     FileNodeDiffRelease(diff, k);
 
+    printf("Testing FileTreeEncoderRead() in small pieces.\n");
+    t2 = FileTreeFromMemoryBlock(&mb, ".");
+    FileTreeEncoderInit(&enc, t2);
+    buf = (unsigned char *)Mmalloc(mb.size + 1);
+    k = 0;
+    while (k <= mb.size && (n = FileTreeEncoderRead(&enc, buf + k, (mb.size + 1 - k < 7) ? (mb.size + 1 - k) : 7)) > 0)
+        k += n;
+    FileTreeEncoderDeInit(&enc);
+    FileTreeDeInit(t2);
+    Mfree(t2);
+    printf("T10:\t%u bytes encoded, %u expected...", (unsigned int)k, (unsigned int)mb.size);
+    if (k == mb.size && memcmp(buf, mb.ptr, mb.size) == 0)
+        printf("PASSED\n");
+    else
+    {
+        printf("TEST FAILED\n");
+        Mfree(buf);
+        MBfree(&mb);
+        MBfree(&mb2);
+        return 1;
+    }
+
+    printf("Testing FileTreeDecoderFeed() one byte at a time.\n");
+    FileTreeDecoderInit(&dec, ".");
+    for (k = 0; k < mb.size; k += 1)
+        if (FileTreeDecoderFeed(&dec, buf + k, 1))
+            break;
+    t2 = FileTreeDecoderFinish(&dec);
+    t3 = FileTreeFromMemoryBlock(&mb, ".");
+    printf("T11:\t%p returned", t2);
+    if (t2 && t2->totalFilesLen == t3->totalFilesLen && t2->totalFoldersLen == t3->totalFoldersLen && FileTreeDiff(t3, t2, &diff, &k) == 0)
+    {
+        printf("...PASSED\n");
+        FileNodeDiffRelease(diff, k);
+    }
+    else
+    {
+        printf("...TEST FAILED\n");
+        if (t2)
+        {
+            FileTreeDeInit(t2);
+            Mfree(t2);
+        }
+        FileTreeDeInit(t3);
+        Mfree(t3);
+        Mfree(buf);
+        MBfree(&mb);
+        MBfree(&mb2);
+        return 1;
+    }
+    FileTreeDeInit(t2);
+    Mfree(t2);
+    FileTreeDeInit(t3);
+    Mfree(t3);
+
+    printf("Testing FileTreeDecoderFinish() truncated and overlong input.\n");
+    FileTreeDecoderInit(&dec, ".");
+    FileTreeDecoderFeed(&dec, buf, mb.size - 1);
+    t2 = FileTreeDecoderFinish(&dec);
+    buf[mb.size] = 0;
+    FileTreeDecoderInit(&dec, ".");
+    r = FileTreeDecoderFeed(&dec, buf, mb.size + 1);
+    t3 = FileTreeDecoderFinish(&dec);
+    Mfree(buf);
+    printf("T12:\t%p and %p returned, %d from feeding...", t2, t3, r);
+    if (t2 == NULL && t3 == NULL && r)
+        printf("PASSED\n");
+    else
+    {
+        printf("TEST FAILED\n");
+        MBfree(&mb);
+        MBfree(&mb2);
+        return 1;
+    }
+
     MBfree(&mb);
     MBfree(&mb2);
     j = MDebug();
     printf("Testing Memory Leaks.\n");
-    printf("T10:\tExpected = %u, Actual = %u...", (unsigned int)i, (unsigned int)j);
+    printf("T13:\tExpected = %u, Actual = %u...", (unsigned int)i, (unsigned int)j);
     if (i == j)
         printf("PASSED\n");
     else
@@ -1,6 +1,7 @@
 #include <pthread.h>
 #include <stdio.h>
 
+#include "compressor_test.h"
 #include "config.h"
 #include "configurer_test.h"
 #include "filetree_test.h"
@@ -14,6 +15,8 @@ static int _selfTest(void)
         return 1;
     if (strings_test())
         return 1;
+    if (compressor_test())
+        return 1;
     if (filetree_test())
         return 1;
     if (socketLibInit())
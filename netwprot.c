@@ -3,43 +3,214 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/uio.h>
+#endif
 
+#include "compressor.h"
+#include "mb.h"
 #include "mm.h"
 #include "netwprot.h"
 
-static int _RawReadSocket(SOCKET s, void *buf, int desiredLength, int *actualLength, struct timeval *timeout);
-static int _ReadUint16(SOCKET s, uint16_t *out, struct timeval *timeout);
-static int _ReadUint32(SOCKET s, uint32_t *out, struct timeval *timeout);
-static unsigned char *_ReadRawData(SOCKET s, int length, struct timeval *timeout);
-static int _RawWriteSocket(SOCKET s, const void *buf, int length);
-static int _SendUInt16(SOCKET s, uint16_t data);
-static int _SendUInt32(SOCKET s, uint32_t data);
+/* Compressed message bodies and file blocks start with the codec and a length */
+#define _COMPRESSED_HEADER_LENGTH 5
+/* A ranged transfer starts with the total size and the first offset */
+#define _RANGED_HEADER_LENGTH 16
+/* Every range starts with its offset and length */
+#define _RANGE_HEADER_LENGTH 12
+/* Every message starts with its type and length */
+#define _FRAME_HEADER_LENGTH 6
+/* Buffers handed to a single vectored send, at most */
+#define _WRITE_VECTOR_MAX 16
+/* Every stream chunk starts with the stream ID and its offset */
+#define _STREAM_HEADER_LENGTH 12
+/* Rate windows end at a pause longer than this, or than two round trips */
+#define _RATE_PAUSE_MIN_IN_MICROSECOND 100000
 
-int NetwProtReadFrom(SOCKET s, SocketMessage_t *sm, struct timeval *timeout)
+static int _WaitReadable(SOCKET s, struct timeval *timeout);
+static int _WaitWritable(SOCKET s, struct timeval *timeout);
+static int _RawReadSocket(SOCKET s, void *buf, size_t length, size_t *received, struct timeval *timeout);
+static int _ConnFill(SocketConnection_t *conn, struct timeval *timeout);
+static int _ConnReadable(SocketConnection_t *conn);
+static int _ReadFrame(SocketConnection_t *conn, SocketMessage_t *sm, struct timeval *timeout);
+static int _ConnRead(SocketConnection_t *conn, void *buf, size_t length, struct timeval *timeout);
+static unsigned char *_ConnReserve(unsigned char **buf, size_t *size, size_t length);
+static int _RawWriteSocketV(SOCKET s, MemoryBlock_t *blocks, size_t n, struct timeval *stall);
+static int _ConnWrite(SocketConnection_t *conn, MemoryBlock_t *blocks, size_t n);
+static void _SetBlock(MemoryBlock_t *m, const void *ptr, size_t size);
+static unsigned int _ConnCodec(const SocketConnection_t *conn);
+static int _CompressMessage(unsigned int codec, const SocketMessage_t *sm, SocketMessage_t *out);
+static int _DecompressMessage(SocketConnection_t *conn, SocketMessage_t *sm);
+static void _WriteCompressedHeader(unsigned char *buf, unsigned int codec, uint32_t length);
+static int _SendFileBlock(SocketConnection_t *conn, const unsigned char *prefix, size_t prefixLength, const unsigned char *buf, size_t length, unsigned char *work);
+static int _RecvFileBlock(SocketConnection_t *conn, unsigned char *buf, size_t length, unsigned char *work, struct timeval *timeout);
+static int _SendFileLegacy(SocketConnection_t *conn, const char *filepath);
+static int _RecvFileLegacy(SocketConnection_t *conn, const char *savefilepath, struct timeval *timeout);
+static int _SendFileRanged(SocketConnection_t *conn, const char *filepath, uint64_t offset);
+static int _RecvFileRanged(SocketConnection_t *conn, const char *savefilepath, uint64_t offset, struct timeval *timeout);
+static int _FileSeek(FILE *f, uint64_t offset);
+static NetwProtStream_t *_StreamFind(NetwProtStream_t *streams, uint32_t id);
+static size_t _StreamsActive(const NetwProtStream_t *streams);
+static void _StreamClose(NetwProtStream_t *st, int state);
+static int _StreamPump(SocketConnection_t *conn);
+static int _StreamDeliver(SocketConnection_t *conn, const SocketMessage_t *sm);
+static uint64_t _Now(void);
+static int _RateAdd(NetwProtRate_t *r, size_t n, uint64_t now, uint64_t pause);
+static void _LinkReceived(SocketConnection_t *conn, size_t n);
+static void _LinkSent(SocketConnection_t *conn, size_t n);
+static void _LinkUpdate(SocketConnection_t *conn);
+static void _LinkTimeout(const SocketConnection_t *conn, const struct timeval *timeout, const NetwProtRate_t *rate, struct timeval *tv);
+
+void NetwProtConnInit(SocketConnection_t *conn, SOCKET s)
 {
-    if (_ReadUint16(s, &(sm->messageType), timeout))
-        return 1;
-    if (_ReadUint32(s, &(sm->messageLength), timeout))
-        return 1;
-    if ((sm->message = _ReadRawData(s, (int)(sm->messageLength), timeout)) == NULL)
-        return 1;
-    return 0;
+    conn->s = s;
+    conn->features = 0;
+    conn->writeQueueLength = 0;
+    conn->readStart = conn->readEnd = 0;
+    conn->messageBuffer = conn->inflateBuffer = NULL;
+    conn->messageBufferSize = conn->inflateBufferSize = 0;
+    memset(conn->outStreams, 0, sizeof(conn->outStreams));
+    memset(conn->inStreams, 0, sizeof(conn->inStreams));
+    conn->nextOutStream = 0;
+    conn->lastStreamId = 0;
+    conn->chunkBuffer = NULL;
+    memset(&(conn->link), 0, sizeof(conn->link));
+    conn->link.bufferLimit = socketBufferLimit();
+    socketGetBufferSizes(s, &(conn->link.sendBuffer), &(conn->link.recvBuffer));
+    /* Every exchange is a small request waiting for its response, Nagle only delays them */
+    socketSetNoDelay(s);
 }
 
-int NetwProtSendTo(SOCKET s, const SocketMessage_t *sm)
+void NetwProtConnDeInit(SocketConnection_t *conn)
 {
-    if (_SendUInt16(s, sm->messageType))
-        return 1;
-    if (_SendUInt32(s, sm->messageLength))
-        return 1;
-    if (_RawWriteSocket(s, sm->message, sm->messageLength))
+    size_t i;
+
+    for (i = 0; i < NETWPROT_MAX_STREAMS; i += 1)
+    {
+        _StreamClose(conn->outStreams + i, NETWPROT_STREAM_STATE_FREE);
+        _StreamClose(conn->inStreams + i, NETWPROT_STREAM_STATE_FREE);
+    }
+    if (conn->chunkBuffer)
+        Mfree(conn->chunkBuffer);
+    conn->chunkBuffer = NULL;
+    if (conn->messageBuffer)
+        Mfree(conn->messageBuffer);
+    if (conn->inflateBuffer)
+        Mfree(conn->inflateBuffer);
+    conn->messageBuffer = conn->inflateBuffer = NULL;
+    conn->messageBufferSize = conn->inflateBufferSize = 0;
+}
+
+uint32_t NetwProtSupportedFeatures(void)
+{
+    uint32_t features = 0;
+
+    if (CompressorIsAvailable(COMPRESSOR_CODEC_FAST))
+        features |= NETWPROT_FEATURE_COMPRESSION_FAST;
+    if (CompressorIsAvailable(COMPRESSOR_CODEC_ZLIB))
+        features |= NETWPROT_FEATURE_COMPRESSION_ZLIB;
+    features |= NETWPROT_FEATURE_RANGED_TRANSFER;
+    features |= NETWPROT_FEATURE_MULTIPLEX;
+    features |= NETWPROT_FEATURE_FILETREE_STREAM;
+
+    return features;
+}
+
+uint32_t NetwProtNegotiateFeatures(uint32_t requested)
+{
+    uint32_t features = requested & NetwProtSupportedFeatures();
+
+    /* Prefer the better ratio. Inter-site links are slower than either codec */
+    if (features & NETWPROT_FEATURE_COMPRESSION_ZLIB)
+        features &= ~(uint32_t)NETWPROT_FEATURE_COMPRESSION_FAST;
+    /* Streams resume like ranged transfers */
+    if (!(features & NETWPROT_FEATURE_RANGED_TRANSFER))
+        features &= ~(uint32_t)NETWPROT_FEATURE_MULTIPLEX;
+
+    return features;
+}
+
+void NetwProtSetFeatures(SocketConnection_t *conn, uint32_t features)
+{
+    conn->features = features & NetwProtSupportedFeatures();
+    /* The handshake gives the first round-trip time */
+    socketGetRtt(conn->s, &(conn->link.rtt), &(conn->link.rttVar));
+}
+
+int NetwProtReadFrom(SocketConnection_t *conn, SocketMessage_t *sm, struct timeval *timeout)
+{
+    while (1)
+    {
+        /* Messages from the peer come first, streams only use the link while it has nothing to say */
+        while (_StreamsActive(conn->outStreams) && !_ConnReadable(conn))
+        {
+            if (_StreamPump(conn))
+                return 1;
+        }
+
+        if (_ReadFrame(conn, sm, timeout))
+            return 1;
+        if (sm->messageType != NETWPROT_SM_MESSAGE_TYPE_STREAM_DATA || !(conn->features & NETWPROT_FEATURE_MULTIPLEX))
+            return 0;
+        if (_StreamDeliver(conn, sm))
+            return 1;
+    }
+}
+
+int NetwProtSendTo(SocketConnection_t *conn, const SocketMessage_t *sm)
+{
+    if (NetwProtQueue(conn, sm))
         return 1;
-    return 0;
+    return NetwProtFlush(conn);
+}
+
+int NetwProtQueue(SocketConnection_t *conn, const SocketMessage_t *sm)
+{
+    SocketMessage_t csm;
+    const SocketMessage_t *out = sm;
+    MemoryBlock_t blocks[2];
+    unsigned char header[_FRAME_HEADER_LENGTH];
+    int compressed, r = 0;
+
+    compressed = (_CompressMessage(_ConnCodec(conn), sm, &csm) == 0);
+    if (compressed)
+        out = &csm;
+
+    NetwProtUInt16ToBuf(header, out->messageType);
+    NetwProtUInt32ToBuf(header + sizeof(uint16_t), out->messageLength);
+    if (conn->writeQueueLength + sizeof(header) + out->messageLength > NETWPROT_WRITE_QUEUE_SIZE)
+    {
+        /* Too large to be copied, send it right away behind what is already queued */
+        _SetBlock(blocks, header, sizeof(header));
+        _SetBlock(blocks + 1, out->message, out->messageLength);
+        r = _ConnWrite(conn, blocks, 2);
+    }
+    else
+    {
+        memcpy(conn->writeQueue + conn->writeQueueLength, header, sizeof(header));
+        conn->writeQueueLength += sizeof(header);
+        memcpy(conn->writeQueue + conn->writeQueueLength, out->message, out->messageLength);
+        conn->writeQueueLength += out->messageLength;
+    }
+
+    if (compressed)
+        Mfree(csm.message);
+    return r;
+}
+
+int NetwProtFlush(SocketConnection_t *conn)
+{
+    if (conn->writeQueueLength == 0)
+        return 0;
+    return _ConnWrite(conn, NULL, 0);
 }
 
 void NetwProtFreeSocketMesg(SocketMessage_t *sm)
 {
-    Mfree(sm->message);
+    sm->message = NULL;
+    sm->messageLength = 0;
 }
 
 void NetwProtUInt8ToBuf(unsigned char *buf, uint8_t data)
@@ -117,6 +288,31 @@ void NetwProtBufToUInt32(const unsigned char *buf, uint32_t *out)
     *out = r;
 }
 
+void NetwProtUInt64ToBuf(unsigned char *buf, uint64_t data)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(data); i += 1)
+    {
+        buf[sizeof(data) - i - 1] = (unsigned char)(data & 0xFF);
+        data = (uint64_t)(data >> 8);
+    }
+}
+
+void NetwProtBufToUInt64(const unsigned char *buf, uint64_t *out)
+{
+    size_t i;
+    uint64_t r = 0;
+
+    for (i = 0; i < sizeof(*out); i += 1)
+    {
+        r = (uint64_t)(r << 8);
+        r += buf[i];
+    }
+
+    *out = r;
+}
+
 void NetwProtSetSM(SocketMessage_t *sm, uint16_t type, uint32_t length, unsigned char *mesg)
 {
     sm->messageType = type;
@@ -124,12 +320,134 @@ void NetwProtSetSM(SocketMessage_t *sm, uint16_t type, uint32_t length, unsigned
     sm->message = mesg;
 }
 
-int NetwProtSendFile(SOCKET s, const char *filepath)
+int NetwProtSendFile(SocketConnection_t *conn, const char *filepath, uint64_t offset)
+{
+    if (conn->features & NETWPROT_FEATURE_RANGED_TRANSFER)
+        return _SendFileRanged(conn, filepath, offset);
+    if (offset)
+        return 1;
+    return _SendFileLegacy(conn, filepath);
+}
+
+int NetwProtRecvFile(SocketConnection_t *conn, const char *savefilepath, uint64_t offset, struct timeval *timeout)
 {
-    unsigned char buf[NETWPROT_FILE_TRANSFER_BUFFER_SIZE];
+    if (conn->features & NETWPROT_FEATURE_RANGED_TRANSFER)
+        return _RecvFileRanged(conn, savefilepath, offset, timeout);
+    if (offset)
+        return 1;
+    return _RecvFileLegacy(conn, savefilepath, timeout);
+}
+
+int NetwProtStreamSendFile(SocketConnection_t *conn, const char *filepath, uint64_t offset, uint32_t *id, uint64_t *total)
+{
+    NetwProtStream_t *st;
+    struct stat s;
+    FILE *f;
+
+    if (!(conn->features & NETWPROT_FEATURE_MULTIPLEX))
+        return 1;
+    if (stat(filepath, &s) || offset > (uint64_t)s.st_size)
+        return 1;
+
+    conn->lastStreamId += 1;
+    if (conn->lastStreamId == 0)
+        conn->lastStreamId = 1;
+    *id = conn->lastStreamId;
+    *total = (uint64_t)s.st_size;
+    if (offset == *total)
+        return 0;
+
+    st = _StreamFind(conn->outStreams, 0);
+    if (!st)
+        return 1;
+    f = fopen(filepath, "rb");
+    if (!f)
+        return 1;
+    if (_FileSeek(f, offset))
+    {
+        fclose(f);
+        return 1;
+    }
+
+    st->id = *id;
+    st->state = NETWPROT_STREAM_STATE_ACTIVE;
+    st->f = f;
+    st->position = offset;
+    st->total = *total;
+    return 0;
+}
+
+int NetwProtStreamRecvFile(SocketConnection_t *conn, uint32_t id, const char *savefilepath, uint64_t offset, uint64_t total)
+{
+    NetwProtStream_t *st;
+
+    if (!(conn->features & NETWPROT_FEATURE_MULTIPLEX) || id == 0 || offset > total)
+        return 1;
+    if (_StreamFind(conn->inStreams, id))
+        return 1;
+    st = _StreamFind(conn->inStreams, 0);
+    if (!st)
+        return 1;
+
+    st->f = fopen(savefilepath, (offset) ? "ab" : "wb");
+    if (!st->f)
+        return 1;
+    st->id = id;
+    st->state = NETWPROT_STREAM_STATE_ACTIVE;
+    st->position = offset;
+    st->total = total;
+    if (offset == total)
+        _StreamClose(st, NETWPROT_STREAM_STATE_DONE);
+    return 0;
+}
+
+int NetwProtWaitStreams(SocketConnection_t *conn, size_t maxActive, struct timeval *timeout)
+{
+    SocketMessage_t sm;
+
+    while (_StreamsActive(conn->inStreams) > maxActive)
+    {
+        if (_ReadFrame(conn, &sm, timeout))
+            return 1;
+        /* Nothing but chunks is expected while no request is pending */
+        if (sm.messageType != NETWPROT_SM_MESSAGE_TYPE_STREAM_DATA)
+            return 1;
+        if (_StreamDeliver(conn, &sm))
+            return 1;
+    }
+
+    return 0;
+}
+
+int NetwProtStreamState(const SocketConnection_t *conn, uint32_t id)
+{
+    size_t i;
+
+    for (i = 0; i < NETWPROT_MAX_STREAMS; i += 1)
+    {
+        if (conn->inStreams[i].state != NETWPROT_STREAM_STATE_FREE && conn->inStreams[i].id == id)
+            return conn->inStreams[i].state;
+    }
+    return NETWPROT_STREAM_STATE_FREE;
+}
+
+void NetwProtStreamRelease(SocketConnection_t *conn, uint32_t id)
+{
+    NetwProtStream_t *st = _StreamFind(conn->inStreams, id);
+
+    if (st)
+        _StreamClose(st, NETWPROT_STREAM_STATE_FREE);
+}
+
+static int _SendFileLegacy(SocketConnection_t *conn, const char *filepath)
+{
+    unsigned char *buf, *work = NULL;
+    unsigned char header[sizeof(uint32_t)];
+    MemoryBlock_t blocks[2];
     struct stat st;
     FILE *f;
-    size_t sent, total, expected, actual;
+    size_t sent, total, expected, actual, blockSize, headerLength;
+    unsigned int codec = _ConnCodec(conn);
     int r = 0;
     uint32_t fileSize;
 
@@ -137,198 +455,884 @@ int NetwProtSendFile(SOCKET s, const char *filepath)
     if (r)
         return 1;
     total = (size_t)st.st_size;
+    if ((uint64_t)st.st_size > UINT32_MAX)
+        return 1;
     fileSize = (uint32_t)total;
-    r = _SendUInt32(s, fileSize);
-    if (r)
-        return r;
 
     f = fopen(filepath, "rb");
     if (!f)
         return 1;
 
+    /* With compression, every block is sent with its own codec so incompressible parts go as they are */
+    /* Without it the file is a plain stream, large writes keep segments full now that Nagle is off */
+    blockSize = NETWPROT_COMPRESSION_BLOCK_SIZE;
+    if (codec != COMPRESSOR_CODEC_NONE)
+        work = (unsigned char *)Mmalloc(_COMPRESSED_HEADER_LENGTH + CompressorBound(codec, blockSize));
+    buf = (unsigned char *)Mmalloc(blockSize);
+
+    /* The size goes out with the first block */
+    NetwProtUInt32ToBuf(header, fileSize);
+    headerLength = sizeof(header);
+    if (total == 0)
+    {
+        _SetBlock(blocks, header, headerLength);
+        r = _ConnWrite(conn, blocks, 1);
+    }
+
     sent = 0;
     while (sent < total)
     {
-        if (sent + sizeof(buf) > total)
+        if (sent + blockSize > total)
             expected = total - sent;
         else
-            expected = sizeof(buf);
+            expected = blockSize;
         actual = fread(buf, 1, expected, f);
         if (actual != expected)
         {
             r = 1;
             break;
         }
-        r = _RawWriteSocket(s, buf, actual);
+        if (codec == COMPRESSOR_CODEC_NONE)
+        {
+            _SetBlock(blocks, header, headerLength);
+            _SetBlock(blocks + 1, buf, actual);
+            r = _ConnWrite(conn, blocks, 2);
+        }
+        else
+            r = _SendFileBlock(conn, header, headerLength, buf, actual, work);
         if (r)
             break;
+        headerLength = 0;
         sent += actual;
     }
 
+    Mfree(buf);
+    if (work)
+        Mfree(work);
     fclose(f);
     return r;
 }
 
-int NetwProtRecvFile(SOCKET s, const char *savefilepath, struct timeval *timeout)
+static int _RecvFileLegacy(SocketConnection_t *conn, const char *savefilepath, struct timeval *timeout)
 {
-    unsigned char *buf;
+    unsigned char header[sizeof(uint32_t)];
+    unsigned char *buf, *work = NULL;
     FILE *f;
-    size_t received, total, expected, actual;
+    size_t received, total, expected, actual, blockSize;
+    unsigned int codec = _ConnCodec(conn);
     uint32_t fileSize;
     int r;
 
-    r = _ReadUint32(s, &fileSize, timeout);
-    if (r)
-        return r;
+    if (_ConnRead(conn, header, sizeof(header), timeout))
+        return 1;
+    NetwProtBufToUInt32(header, &fileSize);
     total = (size_t)fileSize;
 
     f = fopen(savefilepath, "wb");
     if (!f)
         return 1;
 
+    if (codec == COMPRESSOR_CODEC_NONE)
+        blockSize = NETWPROT_FILE_TRANSFER_BUFFER_SIZE;
+    else
+    {
+        blockSize = NETWPROT_COMPRESSION_BLOCK_SIZE;
+        work = (unsigned char *)Mmalloc(CompressorBound(codec, blockSize));
+    }
+    buf = (unsigned char *)Mmalloc(blockSize);
+
+    r = 0;
     received = 0;
     while (received < total)
     {
-        if (received + NETWPROT_FILE_TRANSFER_BUFFER_SIZE > total)
+        if (received + blockSize > total)
             expected = total - received;
         else
-            expected = NETWPROT_FILE_TRANSFER_BUFFER_SIZE;
-        buf = _ReadRawData(s, expected, timeout);
-        if (!buf)
-        {
-            fclose(f);
-            return 1;
-        }
+            expected = blockSize;
+        if (codec == COMPRESSOR_CODEC_NONE)
+            r = _ConnRead(conn, buf, expected, NULL);
+        else
+            r = _RecvFileBlock(conn, buf, expected, work, NULL);
+        if (r)
+            break;
         actual = fwrite(buf, 1, expected, f);
-        Mfree(buf);
         if (actual != expected)
         {
-            fclose(f);
-            return 1;
+            r = 1;
+            break;
         }
         received += actual;
     }
 
+    Mfree(buf);
+    if (work)
+        Mfree(work);
     fclose(f);
-    return 0;
+    return r;
 }
 
 // ==========================
 // Local Function Definitions
 // ==========================
 
-static int _RawReadSocket(SOCKET s, void *buf, int desiredLength, int *actualLength, struct timeval *timeout)
+static int _WaitReadable(SOCKET s, struct timeval *timeout)
 {
     fd_set fset;
     struct timeval tv;
-    int r, byteRead, ret = 0;
 
-    byteRead = 0;
-    if (desiredLength <= 0)
+    FD_ZERO(&fset);
+    FD_SET(s, &fset);
+    memcpy(&tv, timeout, sizeof(tv));
+    return (select(s + 1, &fset, NULL, NULL, &tv) > 0) ? 0 : 1;
+}
+
+static int _WaitWritable(SOCKET s, struct timeval *timeout)
+{
+    fd_set fset;
+    struct timeval tv;
+
+    FD_ZERO(&fset);
+    FD_SET(s, &fset);
+    memcpy(&tv, timeout, sizeof(tv));
+    return (select(s + 1, NULL, &fset, NULL, &tv) > 0) ? 0 : 1;
+}
+
+static int _RawReadSocket(SOCKET s, void *buf, size_t length, size_t *received, struct timeval *timeout)
+{
+    int r;
+
+    if (length > INT32_MAX)
+        length = INT32_MAX;
+
+#ifdef MSG_DONTWAIT
+    /* Only wait when nothing has arrived yet */
+    r = recv(s, buf, length, MSG_DONTWAIT);
+    if (r > 0)
+    {
+        *received = (size_t)r;
+        return 0;
+    }
+    if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        return 1;
+#endif
+
+    if (timeout && _WaitReadable(s, timeout))
+        return 1;
+    r = recv(s, buf, (int)length, 0);
+    if (r <= 0)
+        return 1;
+    *received = (size_t)r;
+    return 0;
+}
+
+static int _ConnFill(SocketConnection_t *conn, struct timeval *timeout)
+{
+    size_t n;
+
+    if (conn->readStart == conn->readEnd)
+        conn->readStart = conn->readEnd = 0;
+    else if (conn->readStart)
+    {
+        memmove(conn->readBuffer, conn->readBuffer + conn->readStart, conn->readEnd - conn->readStart);
+        conn->readEnd -= conn->readStart;
+        conn->readStart = 0;
+    }
+
+    if (_RawReadSocket(conn->s, conn->readBuffer + conn->readEnd, NETWPROT_READ_BUFFER_SIZE - conn->readEnd, &n, timeout))
+        return 1;
+    conn->readEnd += n;
+    _LinkReceived(conn, n);
+    return 0;
+}
+
+static int _ConnReadable(SocketConnection_t *conn)
+{
+    struct timeval tv;
+
+    if (conn->readStart != conn->readEnd)
         return 1;
-    while (byteRead < desiredLength)
+    memset(&tv, 0, sizeof(tv));
+    return (_WaitReadable(conn->s, &tv) == 0) ? 1 : 0;
+}
+
+static int _ConnRead(SocketConnection_t *conn, void *buf, size_t length, struct timeval *timeout)
+{
+    unsigned char *p = (unsigned char *)buf;
+    struct timeval tv;
+    size_t n;
+
+    /* Without a timeout the read is part of a transfer in progress */
+    _LinkTimeout(conn, timeout, &(conn->link.rx), &tv);
+    while (length > 0)
     {
-        if (timeout)
+        if (conn->readStart == conn->readEnd)
         {
-            FD_ZERO(&fset);
-            FD_SET(s, &fset);
-            memcpy(&tv, timeout, sizeof(tv));
-            r = select(s + 1, &fset, NULL, NULL, &tv);
-            if (r < 0)
+            /* Large reads go straight to the destination */
+            if (length >= NETWPROT_READ_BUFFER_SIZE)
+            {
+                if (_RawReadSocket(conn->s, p, length, &n, &tv))
+                    return 1;
+                _LinkReceived(conn, n);
+                p += n;
+                length -= n;
+            }
+            else if (_ConnFill(conn, &tv))
+                return 1;
+
+            /* Once the peer has started answering, only a stall fails the read */
+            if (timeout)
             {
-                ret = 1;
-                break;
+                timeout = NULL;
+                _LinkTimeout(conn, NULL, &(conn->link.rx), &tv);
             }
-            else if (r == 0)
-                break;
+            continue;
         }
 
-        r = recv(s, buf + byteRead, desiredLength - byteRead, 0);
-        if (r < 0)
+        n = conn->readEnd - conn->readStart;
+        if (n > length)
+            n = length;
+        memcpy(p, conn->readBuffer + conn->readStart, n);
+        conn->readStart += n;
+        p += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+static int _ReadFrame(SocketConnection_t *conn, SocketMessage_t *sm, struct timeval *timeout)
+{
+    unsigned char header[_FRAME_HEADER_LENGTH];
+
+    if (_ConnRead(conn, header, sizeof(header), timeout))
+        return 1;
+    NetwProtBufToUInt16(header, &(sm->messageType));
+    NetwProtBufToUInt32(header + sizeof(uint16_t), &(sm->messageLength));
+
+    /* A body which has arrived along with its header is handed out in place */
+    if (conn->readEnd - conn->readStart >= sm->messageLength)
+    {
+        sm->message = conn->readBuffer + conn->readStart;
+        conn->readStart += sm->messageLength;
+    }
+    else
+    {
+        sm->message = _ConnReserve(&(conn->messageBuffer), &(conn->messageBufferSize), sm->messageLength);
+        if (_ConnRead(conn, sm->message, sm->messageLength, NULL))
+            return 1;
+    }
+
+    if (sm->messageType & NETWPROT_SM_MESSAGE_FLAG_COMPRESSED)
+        return _DecompressMessage(conn, sm);
+    return 0;
+}
+
+static unsigned char *_ConnReserve(unsigned char **buf, size_t *size, size_t length)
+{
+    if (*size < length)
+    {
+        if (*buf)
+            Mfree(*buf);
+        *buf = (unsigned char *)Mmalloc(length);
+        *size = length;
+    }
+    return *buf;
+}
+
+static int _RawWriteSocketV(SOCKET s, MemoryBlock_t *blocks, size_t n, struct timeval *stall)
+{
+#ifdef _WIN32
+    const char *p;
+    size_t i, left;
+    int r;
+
+    for (i = 0; i < n; i += 1)
+    {
+        p = (const char *)blocks[i].ptr;
+        left = blocks[i].size;
+        while (left > 0)
         {
-            ret = 1;
-            break;
+            r = send(s, p, (left > INT32_MAX) ? INT32_MAX : (int)left, 0);
+            if (r <= 0)
+                return 1;
+            p += r;
+            left -= (size_t)r;
         }
-        else if (r == 0)
-            break;
-        else if (r > desiredLength)
-            abort();
-        byteRead += r;
     }
+    return 0;
+#else
+    struct iovec iov[_WRITE_VECTOR_MAX];
+    struct msghdr msg;
+    size_t i, count;
+    ssize_t r;
+    int flags = 0;
 
-    *actualLength = byteRead;
-    return ret;
+#ifdef MSG_DONTWAIT
+    /* Wait for room in the send buffer ourselves, so a peer which stopped reading is given up on */
+    flags = MSG_DONTWAIT;
+#endif
+
+    i = 0;
+    while (1)
+    {
+        while (i < n && blocks[i].size == 0)
+            i += 1;
+        if (i >= n)
+            return 0;
+
+        count = 0;
+        memset(&msg, 0, sizeof(msg));
+        for (; i + count < n && count < _WRITE_VECTOR_MAX; count += 1)
+        {
+            iov[count].iov_base = blocks[i + count].ptr;
+            iov[count].iov_len = blocks[i + count].size;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        r = sendmsg(s, &msg, flags);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && flags && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (_WaitWritable(s, stall))
+                return 1;
+            continue;
+        }
+        if (r <= 0)
+            return 1;
+
+        /* Skip what has been sent. A partial send resumes in the middle of a block */
+        while (i < n && (size_t)r >= blocks[i].size)
+        {
+            r -= (ssize_t)blocks[i].size;
+            blocks[i].size = 0;
+            i += 1;
+        }
+        if (r > 0)
+        {
+            blocks[i].ptr = (unsigned char *)blocks[i].ptr + r;
+            blocks[i].size -= (size_t)r;
+        }
+    }
+#endif
+}
+
+static int _ConnWrite(SocketConnection_t *conn, MemoryBlock_t *blocks, size_t n)
+{
+    MemoryBlock_t vector[_WRITE_VECTOR_MAX];
+    struct timeval tv;
+    size_t i, count = 0, total = 0;
+    int r;
+
+    if (n >= _WRITE_VECTOR_MAX)
+        abort();
+
+    /* Queued messages go first, in the same system call */
+    if (conn->writeQueueLength)
+        _SetBlock(vector + (count++), conn->writeQueue, conn->writeQueueLength);
+    for (i = 0; i < n; i += 1)
+        vector[count++] = blocks[i];
+    for (i = 0; i < count; i += 1)
+        total += vector[i].size;
+
+    _LinkTimeout(conn, NULL, &(conn->link.tx), &tv);
+    r = _RawWriteSocketV(conn->s, vector, count, &tv);
+    conn->writeQueueLength = 0;
+    if (r == 0)
+        _LinkSent(conn, total);
+    return r;
 }
 
-static int _ReadUint16(SOCKET s, uint16_t *out, struct timeval *timeout)
+static void _SetBlock(MemoryBlock_t *m, const void *ptr, size_t size)
 {
-    unsigned char buf[sizeof(*out)];
-    int retLength;
+    m->ptr = (void *)ptr;
+    m->size = size;
+}
+
+static unsigned int _ConnCodec(const SocketConnection_t *conn)
+{
+    if (conn->features & NETWPROT_FEATURE_COMPRESSION_ZLIB)
+        return COMPRESSOR_CODEC_ZLIB;
+    else if (conn->features & NETWPROT_FEATURE_COMPRESSION_FAST)
+        return COMPRESSOR_CODEC_FAST;
+    else
+        return COMPRESSOR_CODEC_NONE;
+}
 
-    if (_RawReadSocket(s, buf, sizeof(buf), &retLength, timeout))
+static int _CompressMessage(unsigned int codec, const SocketMessage_t *sm, SocketMessage_t *out)
+{
+    unsigned char *buf;
+    size_t bound, n;
+
+    if (codec == COMPRESSOR_CODEC_NONE || sm->messageLength < NETWPROT_COMPRESSION_MIN_LENGTH)
+        return 1;
+    if (!CompressorIsCompressible(codec, sm->message, sm->messageLength))
         return 1;
-    if (retLength != sizeof(buf))
+
+    bound = CompressorBound(codec, sm->messageLength);
+    buf = (unsigned char *)Mmalloc(_COMPRESSED_HEADER_LENGTH + bound);
+    n = CompressorCompress(codec, buf + _COMPRESSED_HEADER_LENGTH, bound, sm->message, sm->messageLength);
+    if (n == 0 || n + _COMPRESSED_HEADER_LENGTH >= sm->messageLength)
+    {
+        Mfree(buf);
         return 1;
-    NetwProtBufToUInt16(buf, out);
+    }
+
+    _WriteCompressedHeader(buf, codec, sm->messageLength);
+    NetwProtSetSM(out, sm->messageType | NETWPROT_SM_MESSAGE_FLAG_COMPRESSED, (uint32_t)(n + _COMPRESSED_HEADER_LENGTH), buf);
     return 0;
 }
 
-static int _ReadUint32(SOCKET s, uint32_t *out, struct timeval *timeout)
+static int _DecompressMessage(SocketConnection_t *conn, SocketMessage_t *sm)
 {
-    unsigned char buf[sizeof(*out)];
-    int retLength;
+    unsigned char *buf;
+    size_t payloadLength;
+    unsigned int codec;
+    uint32_t rawLength;
 
-    if (_RawReadSocket(s, buf, sizeof(buf), &retLength, timeout))
+    if (_ConnCodec(conn) == COMPRESSOR_CODEC_NONE || sm->messageLength <= _COMPRESSED_HEADER_LENGTH)
         return 1;
-    if (retLength != sizeof(buf))
+
+    codec = sm->message[0];
+    NetwProtBufToUInt32(sm->message + 1, &rawLength);
+    payloadLength = sm->messageLength - _COMPRESSED_HEADER_LENGTH;
+    if (codec != _ConnCodec(conn))
+        return 1;
+    if (rawLength == 0 || rawLength / NETWPROT_COMPRESSION_MAX_RATIO > payloadLength)
         return 1;
-    NetwProtBufToUInt32(buf, out);
+
+    buf = _ConnReserve(&(conn->inflateBuffer), &(conn->inflateBufferSize), rawLength);
+    if (CompressorDecompress(codec, buf, rawLength, sm->message + _COMPRESSED_HEADER_LENGTH, payloadLength))
+        return 1;
+
+    NetwProtSetSM(sm, sm->messageType & ~NETWPROT_SM_MESSAGE_FLAG_COMPRESSED, rawLength, buf);
     return 0;
 }
 
-static unsigned char *_ReadRawData(SOCKET s, int length, struct timeval *timeout)
+static void _WriteCompressedHeader(unsigned char *buf, unsigned int codec, uint32_t length)
 {
-    unsigned char *buf;
-    int actualLength;
+    buf[0] = (unsigned char)codec;
+    NetwProtUInt32ToBuf(buf + 1, length);
+}
+
+static int _SendFileBlock(SocketConnection_t *conn, const unsigned char *prefix, size_t prefixLength, const unsigned char *buf, size_t length, unsigned char *work)
+{
+    MemoryBlock_t blocks[3];
+    unsigned int codec = _ConnCodec(conn);
+    size_t n = 0;
+
+    if (CompressorIsCompressible(codec, buf, length))
+        n = CompressorCompress(codec, work + _COMPRESSED_HEADER_LENGTH, CompressorBound(codec, length), buf, length);
+
+    _SetBlock(blocks, prefix, prefixLength);
+    if (n == 0 || n >= length)
+    {
+        _WriteCompressedHeader(work, COMPRESSOR_CODEC_NONE, (uint32_t)length);
+        _SetBlock(blocks + 1, work, _COMPRESSED_HEADER_LENGTH);
+        _SetBlock(blocks + 2, buf, length);
+        return _ConnWrite(conn, blocks, 3);
+    }
+
+    _WriteCompressedHeader(work, codec, (uint32_t)n);
+    _SetBlock(blocks + 1, work, n + _COMPRESSED_HEADER_LENGTH);
+    return _ConnWrite(conn, blocks, 2);
+}
+
+static int _RecvFileBlock(SocketConnection_t *conn, unsigned char *buf, size_t length, unsigned char *work, struct timeval *timeout)
+{
+    unsigned char header[_COMPRESSED_HEADER_LENGTH];
+    unsigned int codec = _ConnCodec(conn);
+    uint32_t n;
+
+    if (_ConnRead(conn, header, sizeof(header), timeout))
+        return 1;
+    NetwProtBufToUInt32(header + 1, &n);
+
+    /* A block is either stored or compressed with the negotiated codec */
+    if (header[0] == COMPRESSOR_CODEC_NONE)
+    {
+        if ((size_t)n != length)
+            return 1;
+        return _ConnRead(conn, buf, length, timeout);
+    }
+
+    if (header[0] != codec || n == 0 || (size_t)n > CompressorBound(codec, length))
+        return 1;
+    if (_ConnRead(conn, work, n, timeout))
+        return 1;
+    return CompressorDecompress(codec, buf, length, work, n);
+}
+
+static int _SendFileRanged(SocketConnection_t *conn, const char *filepath, uint64_t offset)
+{
+    unsigned char header[_RANGED_HEADER_LENGTH + _RANGE_HEADER_LENGTH];
+    unsigned char *buf, *work = NULL;
+    MemoryBlock_t blocks[2];
+    struct stat st;
+    FILE *f;
+    uint64_t total, position;
+    size_t expected, actual, headerLength;
+    unsigned int codec = _ConnCodec(conn);
+    int r = 0;
+
+    if (stat(filepath, &st))
+        return 1;
+    total = (uint64_t)st.st_size;
+    if (offset > total)
+        return 1;
+
+    f = fopen(filepath, "rb");
+    if (!f)
+        return 1;
+    if (_FileSeek(f, offset))
+    {
+        fclose(f);
+        return 1;
+    }
+
+    /* The transfer header goes out with the first range */
+    NetwProtUInt64ToBuf(header, total);
+    NetwProtUInt64ToBuf(header + 8, offset);
+    headerLength = _RANGED_HEADER_LENGTH;
+    if (offset == total)
+    {
+        _SetBlock(blocks, header, headerLength);
+        r = _ConnWrite(conn, blocks, 1);
+        fclose(f);
+        return r;
+    }
+
+    buf = (unsigned char *)Mmalloc(NETWPROT_TRANSFER_RANGE_SIZE);
+    work = (unsigned char *)Mmalloc(_COMPRESSED_HEADER_LENGTH + CompressorBound(codec, NETWPROT_TRANSFER_RANGE_SIZE));
+
+    position = offset;
+    while (position < total)
+    {
+        if (total - position < NETWPROT_TRANSFER_RANGE_SIZE)
+            expected = (size_t)(total - position);
+        else
+            expected = NETWPROT_TRANSFER_RANGE_SIZE;
+        actual = fread(buf, 1, expected, f);
+        if (actual != expected)
+        {
+            r = 1;
+            break;
+        }
+
+        NetwProtUInt64ToBuf(header + headerLength, position);
+        NetwProtUInt32ToBuf(header + headerLength + 8, (uint32_t)actual);
+        headerLength += _RANGE_HEADER_LENGTH;
+        if (codec == COMPRESSOR_CODEC_NONE)
+        {
+            _SetBlock(blocks, header, headerLength);
+            _SetBlock(blocks + 1, buf, actual);
+            r = _ConnWrite(conn, blocks, 2);
+        }
+        else
+            r = _SendFileBlock(conn, header, headerLength, buf, actual, work);
+        if (r)
+            break;
+        headerLength = 0;
+        position += actual;
+    }
+
+    Mfree(buf);
+    Mfree(work);
+    fclose(f);
+    return r;
+}
+
+static int _RecvFileRanged(SocketConnection_t *conn, const char *savefilepath, uint64_t offset, struct timeval *timeout)
+{
+    unsigned char header[_RANGED_HEADER_LENGTH];
+    unsigned char *buf, *work;
+    FILE *f;
+    uint64_t total, position;
+    uint32_t length;
+    unsigned int codec = _ConnCodec(conn);
+    int r = 0;
+
+    if (_ConnRead(conn, header, sizeof(header), timeout))
+        return 1;
+    NetwProtBufToUInt64(header, &total);
+    NetwProtBufToUInt64(header + 8, &position);
+    if (position != offset || position > total)
+        return 1;
+
+    /* Resumed transfers append to what earlier attempts have saved */
+    f = fopen(savefilepath, (offset) ? "ab" : "wb");
+    if (!f)
+        return 1;
 
-    buf = (unsigned char *)Mmalloc(length);
-    if (_RawReadSocket(s, buf, length, &actualLength, timeout))
-        goto _ReadRawData_Fail;
-    if (length != actualLength)
-        goto _ReadRawData_Fail;
-    return buf;
+    buf = (unsigned char *)Mmalloc(NETWPROT_TRANSFER_RANGE_SIZE);
+    work = (unsigned char *)Mmalloc(CompressorBound(codec, NETWPROT_TRANSFER_RANGE_SIZE));
+
+    while (position < total)
+    {
+        if (_ConnRead(conn, header, _RANGE_HEADER_LENGTH, NULL))
+        {
+            r = 1;
+            break;
+        }
+        NetwProtBufToUInt64(header, &offset);
+        NetwProtBufToUInt32(header + 8, &length);
+        if (offset != position || length == 0 || length > NETWPROT_TRANSFER_RANGE_SIZE || length > total - position)
+        {
+            r = 1;
+            break;
+        }
+
+        if (codec == COMPRESSOR_CODEC_NONE)
+            r = _ConnRead(conn, buf, length, NULL);
+        else
+            r = _RecvFileBlock(conn, buf, length, work, NULL);
+        if (r)
+            break;
+
+        /* Flush every range, so an interrupted transfer only loses the range in flight */
+        if (fwrite(buf, 1, length, f) != length || fflush(f))
+        {
+            r = 1;
+            break;
+        }
+        position += length;
+    }
 
-_ReadRawData_Fail:
     Mfree(buf);
+    Mfree(work);
+    if (fclose(f))
+        r = 1;
+    return r;
+}
+
+static int _FileSeek(FILE *f, uint64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(f, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+}
+
+static NetwProtStream_t *_StreamFind(NetwProtStream_t *streams, uint32_t id)
+{
+    size_t i;
+
+    /* ID 0 finds a free slot */
+    for (i = 0; i < NETWPROT_MAX_STREAMS; i += 1)
+    {
+        if (id == 0 && streams[i].state == NETWPROT_STREAM_STATE_FREE)
+            return streams + i;
+        if (id != 0 && streams[i].state != NETWPROT_STREAM_STATE_FREE && streams[i].id == id)
+            return streams + i;
+    }
     return NULL;
 }
 
-static int _RawWriteSocket(SOCKET s, const void *buf, int length)
+static size_t _StreamsActive(const NetwProtStream_t *streams)
 {
-    int r;
+    size_t i, n = 0;
 
-    if (length < 0)
+    for (i = 0; i < NETWPROT_MAX_STREAMS; i += 1)
+    {
+        if (streams[i].state == NETWPROT_STREAM_STATE_ACTIVE)
+            n += 1;
+    }
+    return n;
+}
+
+static void _StreamClose(NetwProtStream_t *st, int state)
+{
+    if (st->f && fclose(st->f) && state == NETWPROT_STREAM_STATE_DONE)
+        state = NETWPROT_STREAM_STATE_FAILED;
+    st->f = NULL;
+    st->state = state;
+}
+
+static int _StreamPump(SocketConnection_t *conn)
+{
+    SocketMessage_t sm;
+    NetwProtStream_t *st = NULL;
+    size_t i, expected, actual;
+
+    /* Round robin between the streams in progress */
+    for (i = 0; i < NETWPROT_MAX_STREAMS; i += 1)
+    {
+        st = conn->outStreams + ((conn->nextOutStream + i) % NETWPROT_MAX_STREAMS);
+        if (st->state == NETWPROT_STREAM_STATE_ACTIVE)
+            break;
+    }
+    if (i >= NETWPROT_MAX_STREAMS)
+        return 0;
+    conn->nextOutStream = (conn->nextOutStream + i + 1) % NETWPROT_MAX_STREAMS;
+
+    if (!conn->chunkBuffer)
+        conn->chunkBuffer = (unsigned char *)Mmalloc(_STREAM_HEADER_LENGTH + NETWPROT_STREAM_CHUNK_SIZE);
+    if (st->total - st->position < NETWPROT_STREAM_CHUNK_SIZE)
+        expected = (size_t)(st->total - st->position);
+    else
+        expected = NETWPROT_STREAM_CHUNK_SIZE;
+    actual = fread(conn->chunkBuffer + _STREAM_HEADER_LENGTH, 1, expected, st->f);
+
+    NetwProtUInt32ToBuf(conn->chunkBuffer, st->id);
+    NetwProtUInt64ToBuf(conn->chunkBuffer + 4, st->position);
+    if (actual != expected)
+    {
+        /* An empty chunk tells the receiver the file cannot be read */
+        actual = 0;
+        _StreamClose(st, NETWPROT_STREAM_STATE_FREE);
+    }
+    else
+    {
+        st->position += actual;
+        if (st->position == st->total)
+            _StreamClose(st, NETWPROT_STREAM_STATE_FREE);
+    }
+
+    NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_STREAM_DATA, (uint32_t)(_STREAM_HEADER_LENGTH + actual), conn->chunkBuffer);
+    return NetwProtSendTo(conn, &sm);
+}
+
+static int _StreamDeliver(SocketConnection_t *conn, const SocketMessage_t *sm)
+{
+    NetwProtStream_t *st;
+    uint64_t offset;
+    uint32_t id;
+    size_t length;
+
+    if (sm->messageLength < _STREAM_HEADER_LENGTH)
         return 1;
-    r = send(s, buf, length, 0);
-    if (r <= 0)
+    NetwProtBufToUInt32(sm->message, &id);
+    NetwProtBufToUInt64(sm->message + 4, &offset);
+    length = sm->messageLength - _STREAM_HEADER_LENGTH;
+
+    st = _StreamFind(conn->inStreams, id);
+    if (!st || st->state != NETWPROT_STREAM_STATE_ACTIVE)
+        return 1;
+    if (offset != st->position || length > st->total - st->position)
         return 1;
-    if (r != length)
+    if (length == 0)
+    {
+        _StreamClose(st, NETWPROT_STREAM_STATE_FAILED);
+        return 0;
+    }
+
+    /* Flushed like ranges, so an interrupted stream can be resumed */
+    if (fwrite(sm->message + _STREAM_HEADER_LENGTH, 1, length, st->f) != length || fflush(st->f))
         return 1;
+    st->position += length;
+    if (st->position == st->total)
+        _StreamClose(st, NETWPROT_STREAM_STATE_DONE);
     return 0;
 }
 
-static int _SendUInt16(SOCKET s, uint16_t data)
+static uint64_t _Now(void)
 {
-    unsigned char buf[sizeof(data)];
-    NetwProtUInt16ToBuf(buf, data);
+    struct timespec ts;
 
-    return _RawWriteSocket(s, buf, sizeof(buf));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)(ts.tv_nsec / 1000);
 }
 
-static int _SendUInt32(SOCKET s, uint32_t data)
+static int _RateAdd(NetwProtRate_t *r, size_t n, uint64_t now, uint64_t pause)
 {
-    unsigned char buf[sizeof(data)];
-    NetwProtUInt32ToBuf(buf, data);
+    uint64_t sample;
+
+    /* Bytes after a pause arrived at an unknown time, they only start a new window */
+    if (r->last == 0 || now - r->last > pause)
+    {
+        r->start = r->last = now;
+        r->bytes = 0;
+        return 0;
+    }
+
+    r->bytes += n;
+    r->last = now;
+    if (r->bytes < NETWPROT_RATE_WINDOW || now == r->start)
+        return 0;
+
+    sample = r->bytes * 1000000 / (now - r->start);
+    r->rate = (r->rate) ? ((r->rate * 3 + sample) >> 2) : sample;
+    r->start = now;
+    r->bytes = 0;
+    return 1;
+}
+
+static void _LinkReceived(SocketConnection_t *conn, size_t n)
+{
+    NetwProtLink_t *link = &(conn->link);
+    uint64_t pause = ((uint64_t)link->rtt + ((uint64_t)link->rttVar << 2)) << 1;
+
+    if (pause < _RATE_PAUSE_MIN_IN_MICROSECOND)
+        pause = _RATE_PAUSE_MIN_IN_MICROSECOND;
+    link->unanswered = 0;
+    if (_RateAdd(&(link->rx), n, _Now(), pause))
+        _LinkUpdate(conn);
+}
+
+static void _LinkSent(SocketConnection_t *conn, size_t n)
+{
+    NetwProtLink_t *link = &(conn->link);
+    uint64_t pause = ((uint64_t)link->rtt + ((uint64_t)link->rttVar << 2)) << 1;
+
+    if (pause < _RATE_PAUSE_MIN_IN_MICROSECOND)
+        pause = _RATE_PAUSE_MIN_IN_MICROSECOND;
+    link->unanswered += n;
+    if (_RateAdd(&(link->tx), n, _Now(), pause))
+        _LinkUpdate(conn);
+}
+
+static void _LinkUpdate(SocketConnection_t *conn)
+{
+    NetwProtLink_t *link = &(conn->link);
+    uint64_t rate, target, limit;
+
+    socketGetRtt(conn->s, &(link->rtt), &(link->rttVar));
+    rate = (link->rx.rate > link->tx.rate) ? link->rx.rate : link->tx.rate;
+    if (rate == 0 || link->rtt == 0 || link->bufferLimit == 0)
+        return;
+
+    /* Twice the bandwidth-delay product, so the rate measured next is not capped by the window */
+    target = (rate * link->rtt / 1000000) << 1;
+    limit = (link->bufferLimit < NETWPROT_SOCKET_BUFFER_MAX) ? link->bufferLimit : NETWPROT_SOCKET_BUFFER_MAX;
+    if (target < NETWPROT_SOCKET_BUFFER_MIN)
+        target = NETWPROT_SOCKET_BUFFER_MIN;
+    if (target > limit)
+        target = limit;
+
+    /* Only ever raised. Buffers the kernel has grown on its own are left alone */
+    if (target > link->sendBuffer)
+        socketSetSendBuffer(conn->s, (size_t)target);
+    if (target > link->recvBuffer)
+        socketSetRecvBuffer(conn->s, (size_t)target);
+    socketGetBufferSizes(conn->s, &(link->sendBuffer), &(link->recvBuffer));
+}
+
+static void _LinkTimeout(const SocketConnection_t *conn, const struct timeval *timeout, const NetwProtRate_t *rate, struct timeval *tv)
+{
+    const NetwProtLink_t *link = &(conn->link);
+    uint64_t us, queued;
+
+    if (timeout)
+    {
+        /* The peer cannot answer before it has what we sent */
+        us = (uint64_t)timeout->tv_sec * 1000000 + (uint64_t)timeout->tv_usec;
+        queued = (link->unanswered < link->sendBuffer) ? link->unanswered : link->sendBuffer;
+        if (link->tx.rate)
+            us += queued * 1000000 / link->tx.rate;
+    }
+    else
+    {
+        us = (uint64_t)NETWPROT_STALL_RTT_FACTOR * ((uint64_t)link->rtt + ((uint64_t)link->rttVar << 2));
+        if (rate->rate)
+            us += (uint64_t)NETWPROT_READ_BUFFER_SIZE * 1000000 / rate->rate;
+        if (us < (uint64_t)NETWPROT_STALL_MIN_IN_SECOND * 1000000)
+            us = (uint64_t)NETWPROT_STALL_MIN_IN_SECOND * 1000000;
+        if (us > (uint64_t)NETWPROT_STALL_MAX_IN_SECOND * 1000000)
+            us = (uint64_t)NETWPROT_STALL_MAX_IN_SECOND * 1000000;
+    }
 
-    return _RawWriteSocket(s, buf, sizeof(buf));
+    tv->tv_sec = (time_t)(us / 1000000);
+    tv->tv_usec = (long)(us % 1000000);
 }
@@ -1,6 +1,12 @@
 #ifndef _NETWPROT_H_LOADED
 #define _NETWPROT_H_LOADED
 
+/* size_t */
+#include <stddef.h>
+
+/* FILE */
+#include <stdio.h>
+
 /* uint16_t */
 #include <stdint.h>
 
@@ -10,6 +16,20 @@
 #define NETWPROT_IDLE_TIMEOUT_CLIENT_IN_SECOND 20
 #define NETWPROT_IDLE_TIMEOUT_SERVER_IN_SECOND 120
 
+/* Timeouts passed to the functions below bound the wait for the peer to start answering, */
+/* plus the time our own send buffer needs to drain at the measured rate. */
+/* Once data flows, a transfer only fails after a stall of STALL_RTT_FACTOR round trips */
+/* plus the time one read buffer takes at the measured rate, within these bounds */
+#define NETWPROT_STALL_MIN_IN_SECOND 8
+#define NETWPROT_STALL_MAX_IN_SECOND 120
+#define NETWPROT_STALL_RTT_FACTOR 16
+
+/* Throughput is sampled over windows of at least this many bytes */
+#define NETWPROT_RATE_WINDOW 262144
+/* Socket buffers are raised to twice the bandwidth-delay product, within these bounds */
+#define NETWPROT_SOCKET_BUFFER_MIN 65536
+#define NETWPROT_SOCKET_BUFFER_MAX 16777216
+
 #define NETWPROT_SM_TYPE_LENGTH 2
 #define NETWPROT_SM_LENGTH_LENGTH 2
 
@@ -21,12 +41,88 @@
 #define NETWPROT_SM_MESSAGE_TYPE_NOTIFY_FILE_CREATED 6
 #define NETWPROT_SM_MESSAGE_TYPE_REQUEST_FILE 7
 #define NETWPROT_SM_MESSAGE_TYPE_NOTIFY_FILE_CHANGED 8
-#define NETWPROT_SM_MESSAGE_TYPE_MAX 9
+#define NETWPROT_SM_MESSAGE_TYPE_STREAM_DATA 9
+#define NETWPROT_SM_MESSAGE_TYPE_FILETREE_DATA 10
+#define NETWPROT_SM_MESSAGE_TYPE_MAX 11
+
+/* Set in the message type when the body is compressed */
+#define NETWPROT_SM_MESSAGE_FLAG_COMPRESSED 0x8000
+
+/* Optional features, exchanged in the handshake after the magic number */
+#define NETWPROT_FEATURE_COMPRESSION_FAST 0x00000001
+#define NETWPROT_FEATURE_COMPRESSION_ZLIB 0x00000002
+#define NETWPROT_FEATURE_COMPRESSION_MASK 0x00000003
+#define NETWPROT_FEATURE_RANGED_TRANSFER 0x00000004
+/* Downloads are streamed in chunks between other messages. Requires ranged transfers */
+#define NETWPROT_FEATURE_MULTIPLEX 0x00000008
+/* The file tree follows its response in FILETREE_DATA pieces, ended by an empty one */
+#define NETWPROT_FEATURE_FILETREE_STREAM 0x00000010
 
 #define NETWPROT_RESPONSE_OK 0
 
 #define NETWPROT_FILE_TRANSFER_BUFFER_SIZE 1024
 
+/* Messages shorter than this are never compressed */
+#define NETWPROT_COMPRESSION_MIN_LENGTH 256
+/* Files are compressed in independent blocks of this size */
+#define NETWPROT_COMPRESSION_BLOCK_SIZE 65536
+/* Deflate cannot expand data more than this, anything beyond is treated as corrupted */
+#define NETWPROT_COMPRESSION_MAX_RATIO 1032
+
+/* Received bytes are buffered up to this many, so one recv() usually brings whole messages */
+#define NETWPROT_READ_BUFFER_SIZE 16384
+
+/* Small messages are queued up to this many bytes and go out together on the next send or flush */
+#define NETWPROT_WRITE_QUEUE_SIZE 4096
+
+/* Ranged transfers send 64-bit sizes and split the file into (offset, length) ranges of at most this size */
+#define NETWPROT_TRANSFER_RANGE_SIZE 65536
+
+/* Streamed files are cut into chunks of at most this size, other messages wait for one chunk at most */
+#define NETWPROT_STREAM_CHUNK_SIZE 16384
+/* Largest piece of a streamed file tree */
+#define NETWPROT_FILETREE_CHUNK_SIZE 16384
+
+/* Streams in progress at once, in each direction */
+#define NETWPROT_MAX_STREAMS 8
+
+#define NETWPROT_STREAM_STATE_FREE 0
+#define NETWPROT_STREAM_STATE_ACTIVE 1
+#define NETWPROT_STREAM_STATE_DONE 2
+#define NETWPROT_STREAM_STATE_FAILED 3
+
+typedef struct
+{
+    uint32_t id;
+    int state;
+    FILE *f;
+    uint64_t position;
+    uint64_t total;
+} NetwProtStream_t;
+
+/* Throughput over a window of at least NETWPROT_RATE_WINDOW bytes without pauses */
+typedef struct
+{
+    uint64_t start;
+    uint64_t last;
+    uint64_t bytes;
+    uint64_t rate;
+} NetwProtRate_t;
+
+/* What is known about the path to the peer. Times are in microseconds, rates in bytes per second, 0 while unknown */
+typedef struct
+{
+    uint32_t rtt;
+    uint32_t rttVar;
+    NetwProtRate_t rx;
+    NetwProtRate_t tx;
+    /* Bytes sent since anything was received, some of which may still wait in the send buffer */
+    uint64_t unanswered;
+    size_t sendBuffer;
+    size_t recvBuffer;
+    size_t bufferLimit;
+} NetwProtLink_t;
+
 typedef struct
 {
     uint16_t messageType;
@@ -34,8 +130,49 @@ typedef struct
     unsigned char *message;
 } SocketMessage_t;
 
-int NetwProtReadFrom(SOCKET s, SocketMessage_t *sm, struct timeval *timeout);
-int NetwProtSendTo(SOCKET s, const SocketMessage_t *sm);
+typedef struct
+{
+    SOCKET s;
+    uint32_t features;
+    size_t writeQueueLength;
+    unsigned char writeQueue[NETWPROT_WRITE_QUEUE_SIZE];
+    size_t readStart;
+    size_t readEnd;
+    unsigned char readBuffer[NETWPROT_READ_BUFFER_SIZE];
+    /* Reused for bodies which do not fit in the read buffer, and for decompressed ones */
+    unsigned char *messageBuffer;
+    size_t messageBufferSize;
+    unsigned char *inflateBuffer;
+    size_t inflateBufferSize;
+    NetwProtStream_t outStreams[NETWPROT_MAX_STREAMS];
+    NetwProtStream_t inStreams[NETWPROT_MAX_STREAMS];
+    size_t nextOutStream;
+    uint32_t lastStreamId;
+    unsigned char *chunkBuffer;
+    NetwProtLink_t link;
+} SocketConnection_t;
+
+/* Bind a connection to a connected socket and disable Nagle on it. No optional feature is enabled until the handshake */
+void NetwProtConnInit(SocketConnection_t *conn, SOCKET s);
+/* Release the buffers and streams of a connection. The socket is not closed */
+void NetwProtConnDeInit(SocketConnection_t *conn);
+/* Optional features this program can offer in a handshake */
+uint32_t NetwProtSupportedFeatures(void);
+/* Server side of the handshake. Keep the features both ends support, with at most one compression codec */
+uint32_t NetwProtNegotiateFeatures(uint32_t requested);
+/* Enable the negotiated features on a connection */
+void NetwProtSetFeatures(SocketConnection_t *conn, uint32_t features);
+
+/* Read a message. The body belongs to the connection and stays valid until the next read from it */
+/* While waiting, chunks of outgoing streams are sent and chunks of incoming ones are saved */
+int NetwProtReadFrom(SocketConnection_t *conn, SocketMessage_t *sm, struct timeval *timeout);
+/* Send a message, together with any queued ones, in a single system call */
+int NetwProtSendTo(SocketConnection_t *conn, const SocketMessage_t *sm);
+/* Queue a message without sending it. It goes out with the next send, file transfer or flush */
+int NetwProtQueue(SocketConnection_t *conn, const SocketMessage_t *sm);
+/* Send all queued messages */
+int NetwProtFlush(SocketConnection_t *conn);
+/* Done with a received message */
 void NetwProtFreeSocketMesg(SocketMessage_t *sm);
 void NetwProtUInt8ToBuf(unsigned char *buf, uint8_t data);
 void NetwProtBufToUInt8(const unsigned char *buf, uint8_t *out);
@@ -43,8 +180,23 @@ void NetwProtUInt16ToBuf(unsigned char *buf, uint16_t data);
 void NetwProtBufToUInt16(const unsigned char *buf, uint16_t *out);
 void NetwProtUInt32ToBuf(unsigned char *buf, uint32_t data);
 void NetwProtBufToUInt32(const unsigned char *buf, uint32_t *out);
+void NetwProtUInt64ToBuf(unsigned char *buf, uint64_t data);
+void NetwProtBufToUInt64(const unsigned char *buf, uint64_t *out);
 void NetwProtSetSM(SocketMessage_t *sm, uint16_t type, uint32_t length, unsigned char *mesg);
-int NetwProtSendFile(SOCKET s, const char *filepath);
-int NetwProtRecvFile(SOCKET s, const char *savefilepath, struct timeval *timeout);
+/* Send a file starting at offset. Without ranged transfers, offset must be 0 and the file smaller than 4 GB */
+int NetwProtSendFile(SocketConnection_t *conn, const char *filepath, uint64_t offset);
+/* Receive a file. A non-zero offset appends to savefilepath, which must hold exactly offset bytes */
+int NetwProtRecvFile(SocketConnection_t *conn, const char *savefilepath, uint64_t offset, struct timeval *timeout);
+/* Multiplexed connections only. Start streaming a file from offset, returning the stream ID and the file size */
+/* Nothing is sent yet. Chunks go out while NetwProtReadFrom waits for the next request */
+int NetwProtStreamSendFile(SocketConnection_t *conn, const char *filepath, uint64_t offset, uint32_t *id, uint64_t *total);
+/* Multiplexed connections only. Save stream id into savefilepath, which holds offset bytes of total already */
+int NetwProtStreamRecvFile(SocketConnection_t *conn, uint32_t id, const char *savefilepath, uint64_t offset, uint64_t total);
+/* Read chunks until at most maxActive incoming streams are in progress */
+int NetwProtWaitStreams(SocketConnection_t *conn, size_t maxActive, struct timeval *timeout);
+/* State of an incoming stream, NETWPROT_STREAM_STATE_FREE if there is no such stream */
+int NetwProtStreamState(const SocketConnection_t *conn, uint32_t id);
+/* Forget an incoming stream. One still in progress is abandoned, and its remaining chunks break the connection */
+void NetwProtStreamRelease(SocketConnection_t *conn, uint32_t id);
 
 #endif
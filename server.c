@@ -31,7 +31,7 @@ typedef struct
 
 typedef struct
 {
-    SOCKET clientSocket;
+    SocketConnection_t clientConn;
     struct sockaddr_in clientInfo;
 
     SynchronizationServer_t *server;
@@ -51,6 +51,59 @@ static int _HandleIncomingClient(Listener_t *listenerInstance);
 static int _ServerProtocol(ServingData_t *sd);
 static int _ServerProtocolHandshake(ServingData_t *sd);
 static int _ServerProtocolWaitForRequest(ServingData_t *sd);
+static int _ServerProtocolStreamFileTree(ServingData_t *sd)
+{
+    SocketMessage_t sm;
+    FileTreeEncoder_t e;
+    uint32_t mn = 0, g;
+    unsigned char buf[sizeof(mn) + sizeof(g)];
+    unsigned char *chunk;
+    size_t n;
+    int r, changed = 0;
+
+    chunk = (unsigned char *)Mmalloc(NETWPROT_FILETREE_CHUNK_SIZE);
+    pthread_rwlock_rdlock(sd->svrRwLock);
+    g = *(sd->generation);
+    FileTreeEncoderInit(&e, sd->ft);
+    n = FileTreeEncoderRead(&e, chunk, NETWPROT_FILETREE_CHUNK_SIZE);
+    pthread_rwlock_unlock(sd->svrRwLock);
+
+    NetwProtUInt32ToBuf(buf, mn);
+    NetwProtUInt32ToBuf(buf + sizeof(mn), g);
+    NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, sizeof(buf), buf);
+    r = NetwProtQueue(&(sd->clientConn), &sm);
+
+    /* The tree is locked while a piece is encoded, not while it is sent */
+    while (r == 0)
+    {
+        NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_FILETREE_DATA, n, chunk);
+        r = NetwProtSendTo(&(sd->clientConn), &sm);
+        if (r || n == 0)
+            break;
+
+        pthread_rwlock_rdlock(sd->svrRwLock);
+        if (g != *(sd->generation) || *(sd->stopping))
+            changed = 1;
+        else
+            n = FileTreeEncoderRead(&e, chunk, NETWPROT_FILETREE_CHUNK_SIZE);
+        pthread_rwlock_unlock(sd->svrRwLock);
+
+        /* A rescan freed the nodes being encoded. The client gets a failed response in place of the next piece and asks again later */
+        if (changed)
+        {
+            mn = 1;
+            NetwProtUInt32ToBuf(buf, mn);
+            NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, sizeof(mn), buf);
+            r = NetwProtSendTo(&(sd->clientConn), &sm);
+            break;
+        }
+    }
+
+    FileTreeEncoderDeInit(&e);
+    Mfree(chunk);
+    return r;
+}
+
 static int _CreateListener_SetUpSocketAndLocks(SynchronizationServer_t *server, Listener_t *listenerInstance, SOCKET s);
 static void _StartAcceptClients_ResetBeforeSelect(struct timeval *tv, fd_set *fset, SOCKET s);
 static void _SetTimeout(struct timeval *tv, unsigned int seconds);
@@ -60,6 +113,7 @@ static void _PathPostfix(char *pathFromClient);
 
 static int _ServerProtocolRequestHandler_KeepAlive(void **args);
 static int _ServerProtocolRequestHandler_FileTree(void **args);
+static int _ServerProtocolStreamFileTree(ServingData_t *sd);
 static int _ServerProtocolRequestHandler_FileDeletedFromClient(void **args);
 static int _ServerProtocolRequestHandler_FileCreatedFromClient(void **args);
 static int _ServerProtocolRequestHandler_FileRequestFromClient(void **args);
@@ -76,6 +130,8 @@ static _ServerProtocolRequestHandler_t _requestHandler[NETWPROT_SM_MESSAGE_TYPE_
     _ServerProtocolRequestHandler_FileCreatedFromClient, // NETWPROT_SM_MESSAGE_TYPE_NOTIFY_FILE_CREATED
     _ServerProtocolRequestHandler_FileRequestFromClient, // NETWPROT_SM_MESSAGE_TYPE_REQUEST_FILE
     _ServerProtocolRequestHandler_FileChangedFromClient, // NETWPROT_SM_MESSAGE_TYPE_NOTIFY_FILE_CHANGED
+    NULL,                                                // NETWPROT_SM_MESSAGE_TYPE_STREAM_DATA
+    NULL,                                                // NETWPROT_SM_MESSAGE_TYPE_FILETREE_DATA
 };
 
 void *ServerThreadEntry(void *arg)
@@ -208,7 +264,7 @@ static int _HandleIncomingClient(Listener_t *listenerInstance)
     if (c != INVALID_SOCKET)
     {
         sd = (ServingData_t *)Mmalloc(sizeof(*sd));
-        sd->clientSocket = c;
+        NetwProtConnInit(&(sd->clientConn), c);
         sd->server = listenerInstance->server;
         sd->ft = &(listenerInstance->ft);
         sd->svrRwLock = &(listenerInstance->svrRwLock);
@@ -234,14 +290,17 @@ static int _HandleIncomingClient(Listener_t *listenerInstance)
 static void *_ServingThreadEntry(void *arg)
 {
     ServingData_t *sd = (ServingData_t *)arg;
+    pthread_rwlock_t *runningLock = sd->runningLock;
     int oldstate;
 
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-    pthread_rwlock_rdlock(sd->runningLock);
+    pthread_rwlock_rdlock(runningLock);
     _ServerProtocol(sd);
-    pthread_rwlock_unlock(sd->runningLock);
-    socketClose(sd->clientSocket);
+    socketClose(sd->clientConn.s);
+    NetwProtConnDeInit(&(sd->clientConn));
     Mfree(sd);
+    /* Released last, so a stopping listener knows this connection is gone completely */
+    pthread_rwlock_unlock(runningLock);
     return NULL;
 }
 
@@ -260,31 +319,43 @@ static int _ServerProtocolHandshake(ServingData_t *sd)
     SocketMessage_t sm;
     struct timeval tv;
     int r, s;
-    uint32_t mn;
-    unsigned char buf[sizeof(mn)];
+    uint32_t mn, features = 0;
+    unsigned char buf[sizeof(mn) + sizeof(features)];
+    uint32_t responseLength;
 
     _SetTimeout(&tv, NETWPROT_READ_TIMEOUT_IN_SECOND);
-    r = NetwProtReadFrom(sd->clientSocket, &sm, &tv);
+    r = NetwProtReadFrom(&(sd->clientConn), &sm, &tv);
     if (r)
         return 1;
 
-    if (sm.messageType != NETWPROT_SM_MESSAGE_TYPE_HANDSHAKE || sm.messageLength != sizeof(buf))
+    /* Older clients send the magic number alone and get the status alone */
+    if (sm.messageType != NETWPROT_SM_MESSAGE_TYPE_HANDSHAKE || (sm.messageLength != sizeof(mn) && sm.messageLength != sizeof(buf)))
     {
         NetwProtFreeSocketMesg(&sm);
         return 1;
     }
 
     NetwProtBufToUInt32(sm.message, &mn);
+    if (sm.messageLength == sizeof(buf))
+    {
+        NetwProtBufToUInt32(sm.message + sizeof(mn), &features);
+        features = NetwProtNegotiateFeatures(features);
+    }
+    responseLength = sm.messageLength;
     NetwProtFreeSocketMesg(&sm);
 
     if (mn != (uint32_t)(sd->server->magicNumber))
         r = mn = 1;
     else
         r = mn = 0;
+    if (r)
+        features = 0;
 
     NetwProtUInt32ToBuf(buf, mn);
-    NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, sizeof(buf), buf);
-    s = NetwProtSendTo(sd->clientSocket, &sm);
+    NetwProtUInt32ToBuf(buf + sizeof(mn), features);
+    NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, responseLength, buf);
+    s = NetwProtSendTo(&(sd->clientConn), &sm);
+    NetwProtSetFeatures(&(sd->clientConn), features);
 
     return (r | s) ? 1 : 0;
 }
@@ -300,7 +371,7 @@ static int _ServerProtocolWaitForRequest(ServingData_t *sd)
         return 1;
 
     _SetTimeout(&tv, NETWPROT_IDLE_TIMEOUT_SERVER_IN_SECOND);
-    r = NetwProtReadFrom(sd->clientSocket, &sm, &tv);
+    r = NetwProtReadFrom(&(sd->clientConn), &sm, &tv);
     if (r)
         return 1;
 
@@ -330,7 +401,7 @@ static int _ServerProtocolRequestHandler_KeepAlive(void **args)
     NetwProtUInt32ToBuf(buf, mn);
     NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, sizeof(buf), buf);
 
-    return NetwProtSendTo(sd->clientSocket, &sm);
+    return NetwProtSendTo(&(sd->clientConn), &sm);
 }
 
 static int _ServerProtocolRequestHandler_FileTree(void **args)
@@ -345,6 +416,9 @@ static int _ServerProtocolRequestHandler_FileTree(void **args)
     unsigned char bufg[sizeof(*(sd->generation))];
     int r;
 
+    if (sd->clientConn.features & NETWPROT_FEATURE_FILETREE_STREAM)
+        return _ServerProtocolStreamFileTree(sd);
+
     pthread_rwlock_rdlock(sd->svrRwLock);
     FileTreeToMemoryblock(sd->ft, &mb);
     NetwProtUInt32ToBuf(bufg, *(sd->generation));
@@ -359,7 +433,7 @@ static int _ServerProtocolRequestHandler_FileTree(void **args)
     MBfree(&mb);
 
     NetwProtSetSM(&sm, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, out.size, out.ptr);
-    r = NetwProtSendTo(sd->clientSocket, &sm);
+    r = NetwProtSendTo(&(sd->clientConn), &sm);
 
     MBfree(&out);
     return r;
@@ -489,7 +563,7 @@ static int _ServerProtocolRequestHandler_FileDeletedFromClient(void **args)
 
     NetwProtUInt32ToBuf(buf, mn);
     NetwProtSetSM(&res, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, sizeof(buf), buf);
-    return NetwProtSendTo(sd->clientSocket, &res);
+    return NetwProtSendTo(&(sd->clientConn), &res);
 }
 
 static int _ServerProtocolRequestHandler_FileCreatedFromClient(void **args)
@@ -533,12 +607,12 @@ static int _ServerProtocolRequestHandler_FileCreatedFromClient(void **args)
     }
     NetwProtUInt32ToBuf(buf, mn);
     NetwProtSetSM(&res, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, sizeof(buf), buf);
-    r = NetwProtSendTo(sd->clientSocket, &res);
+    r = NetwProtSendTo(&(sd->clientConn), &res);
 
     sprintf(buftmp, "%u", (unsigned int)((size_t)&s));
     temppath = DirManagerPathConcat(sd->server->workingFolder, buftmp);
     _SetTimeout(&tv, NETWPROT_READ_TIMEOUT_IN_SECOND);
-    r = NetwProtRecvFile(sd->clientSocket, temppath, &tv);
+    r = NetwProtRecvFile(&(sd->clientConn), temppath, 0, &tv);
     if (r == 0)
     {
         pthread_rwlock_wrlock(sd->svrRwLock);
@@ -578,9 +652,10 @@ static int _ServerProtocolRequestHandler_FileRequestFromClient(void **args)
     size_t maxSize;
     ServingData_t *sd = args[0];
     SocketMessage_t *sm = args[1];
-    uint32_t g;
+    uint64_t offset = 0, total = 0;
+    uint32_t g, id = 0;
     uint32_t mn = 0;
-    unsigned char buf[sizeof(mn)];
+    unsigned char buf[sizeof(mn) + sizeof(id) + sizeof(total)];
     int r;
 
     ptr = sm->message;
@@ -592,6 +667,12 @@ static int _ServerProtocolRequestHandler_FileRequestFromClient(void **args)
     fullname = MReadString((void **)&ptr, &maxSize);
     if (!fullname)
         return 1;
+    /* Ranged transfers append the offset to resume from */
+    if (maxSize == sizeof(offset) && (sd->clientConn.features & NETWPROT_FEATURE_RANGED_TRANSFER))
+    {
+        NetwProtBufToUInt64(ptr, &offset);
+        maxSize -= sizeof(offset);
+    }
     if (maxSize != 0)
     {
         Mfree(fullname);
@@ -601,19 +682,38 @@ static int _ServerProtocolRequestHandler_FileRequestFromClient(void **args)
 
     realpath = DirManagerPathConcat(sd->server->basePath, fullname);
     r = stat(realpath, &s);
-    if (r)
+    if (r || offset > (uint64_t)s.st_size)
         mn = 1;
 
+    /* Multiplexed downloads are answered with a stream, which is sent while the next requests are served */
+    if (sd->clientConn.features & NETWPROT_FEATURE_MULTIPLEX)
+    {
+        if (mn == 0 && NetwProtStreamSendFile(&(sd->clientConn), realpath, offset, &id, &total))
+            mn = 1;
+        NetwProtUInt32ToBuf(buf, mn);
+        NetwProtUInt32ToBuf(buf + sizeof(mn), id);
+        NetwProtUInt64ToBuf(buf + sizeof(mn) + sizeof(id), total);
+        NetwProtSetSM(&res, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, (mn) ? sizeof(mn) : sizeof(buf), buf);
+        r = NetwProtSendTo(&(sd->clientConn), &res);
+        Mfree(realpath);
+        Mfree(fullname);
+        return (r || mn) ? 1 : 0;
+    }
+
     NetwProtUInt32ToBuf(buf, mn);
-    NetwProtSetSM(&res, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, sizeof(buf), buf);
-    r = NetwProtSendTo(sd->clientSocket, &res);
+    NetwProtSetSM(&res, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, sizeof(mn), buf);
+    /* An accepted request is answered together with the beginning of the file */
+    if (mn)
+        r = NetwProtSendTo(&(sd->clientConn), &res);
+    else
+        r = NetwProtQueue(&(sd->clientConn), &res);
     if (r || mn)
     {
         Mfree(realpath);
         Mfree(fullname);
         return 1;
     }
-    r = NetwProtSendFile(sd->clientSocket, realpath);
+    r = NetwProtSendFile(&(sd->clientConn), realpath, offset);
     Mfree(realpath);
     Mfree(fullname);
     return r;
@@ -665,7 +765,7 @@ static int _ServerProtocolRequestHandler_FileChangedFromClient(void **args)
         mn = 2;
         NetwProtUInt32ToBuf(buf, mn);
         NetwProtSetSM(&res, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, sizeof(buf), buf);
-        NetwProtSendTo(sd->clientSocket, &res);
+        NetwProtSendTo(&(sd->clientConn), &res);
         return 1;
     }
     fullname = MReadString((void **)&ptr, &maxSize);
@@ -680,7 +780,7 @@ static int _ServerProtocolRequestHandler_FileChangedFromClient(void **args)
         mn = 1;
     NetwProtUInt32ToBuf(buf, mn);
     NetwProtSetSM(&res, NETWPROT_SM_MESSAGE_TYPE_RESPONSE, sizeof(buf), buf);
-    r = NetwProtSendTo(sd->clientSocket, &res);
+    r = NetwProtSendTo(&(sd->clientConn), &res);
     if (mn)
     {
         Mfree(realpath);
@@ -691,7 +791,7 @@ static int _ServerProtocolRequestHandler_FileChangedFromClient(void **args)
     sprintf(buftmp, "%u", (unsigned int)((size_t)&s));
     temppath = DirManagerPathConcat(sd->server->workingFolder, buftmp);
     _SetTimeout(&tv, NETWPROT_READ_TIMEOUT_IN_SECOND);
-    r = NetwProtRecvFile(sd->clientSocket, temppath, &tv);
+    r = NetwProtRecvFile(&(sd->clientConn), temppath, 0, &tv);
     if (r == 0)
     {
         pthread_rwlock_wrlock(sd->svrRwLock);
@@ -1,4 +1,6 @@
+#include <limits.h>
 #include <signal.h>
+#include <stdio.h>
 
 #include "xsocket.h"
 
@@ -39,4 +41,87 @@ int socketClose(SOCKET sock)
     return status;
 }
 
+int socketSetNoDelay(SOCKET sock)
+{
+    int one = 1;
+
+    return setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+}
+
+int socketGetRtt(SOCKET sock, uint32_t *rtt, uint32_t *rttVar)
+{
+#if defined(TCP_INFO) && defined(__linux__)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) || info.tcpi_rtt == 0)
+        return 1;
+    *rtt = info.tcpi_rtt;
+    *rttVar = info.tcpi_rttvar;
+    return 0;
+#else
+    sock = sock;
+    rtt = rtt;
+    rttVar = rttVar;
+    return 1;
+#endif
+}
+
+int socketGetBufferSizes(SOCKET sock, size_t *sendBuffer, size_t *recvBuffer)
+{
+    int snd = 0, rcv = 0;
+    socklen_t len;
+
+    len = sizeof(snd);
+    if (getsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&snd, &len))
+        return 1;
+    len = sizeof(rcv);
+    if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&rcv, &len))
+        return 1;
+
+    *sendBuffer = (snd > 0) ? (size_t)snd : 0;
+    *recvBuffer = (rcv > 0) ? (size_t)rcv : 0;
+    return 0;
+}
+
+int socketSetSendBuffer(SOCKET sock, size_t size)
+{
+    int v = (size > INT_MAX) ? INT_MAX : (int)size;
+
+    return setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char *)&v, sizeof(v));
+}
+
+int socketSetRecvBuffer(SOCKET sock, size_t size)
+{
+    int v = (size > INT_MAX) ? INT_MAX : (int)size;
+
+    return setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char *)&v, sizeof(v));
+}
+
+size_t socketBufferLimit(void)
+{
+#ifdef __linux__
+    /* Larger requests are silently cut to these, and would stop the kernel from tuning the buffers itself */
+    const char *files[2] = {"/proc/sys/net/core/wmem_max", "/proc/sys/net/core/rmem_max"};
+    unsigned long v;
+    size_t limit = 0, i;
+    FILE *f;
+
+    for (i = 0; i < 2; i += 1)
+    {
+        f = fopen(files[i], "r");
+        if (!f)
+            return 0;
+        if (fscanf(f, "%lu", &v) != 1)
+            v = 0;
+        fclose(f);
+        if (i == 0 || (size_t)v < limit)
+            limit = (size_t)v;
+    }
+    return limit;
+#else
+    return 0;
+#endif
+}
+
 /* Based on the answer at https://stackoverflow.com/questions/28027937/cross-platform-sockets */
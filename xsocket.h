@@ -1,6 +1,12 @@
 #ifndef _XSOCKET_H_LOADED
 #define _XSOCKET_H_LOADED
 
+/* size_t */
+#include <stddef.h>
+
+/* uint32_t */
+#include <stdint.h>
+
 #ifdef _WIN32
 /* See http://stackoverflow.com/questions/12765743/getaddrinfo-on-win32 */
 #ifndef _WIN32_WINNT
@@ -13,6 +19,8 @@
 /* Assume that any non-Windows platform uses POSIX-style sockets instead. */
 #include <arpa/inet.h>
 #include <netdb.h> /* Needed for getaddrinfo() and freeaddrinfo() */
+#include <netinet/in.h>
+#include <netinet/tcp.h> /* Needed for TCP_NODELAY */
 #include <sys/socket.h>
 #include <unistd.h> /* Needed for close() */
 typedef int SOCKET;
@@ -23,6 +31,17 @@ typedef int SOCKET;
 int socketLibInit(void);
 int socketLibDeInit(void);
 int socketClose(SOCKET sock);
+/* Send small segments immediately instead of waiting for earlier ones to be acknowledged */
+int socketSetNoDelay(SOCKET sock);
+/* Smoothed round-trip time and its variation as measured by the kernel, in microseconds. Non-zero if not available */
+int socketGetRtt(SOCKET sock, uint32_t *rtt, uint32_t *rttVar);
+/* Current sizes of the send and receive buffers */
+int socketGetBufferSizes(SOCKET sock, size_t *sendBuffer, size_t *recvBuffer);
+/* A buffer set explicitly is no longer tuned by the kernel */
+int socketSetSendBuffer(SOCKET sock, size_t size);
+int socketSetRecvBuffer(SOCKET sock, size_t size);
+/* Largest buffer an unprivileged program may ask for, or 0 if unknown */
+size_t socketBufferLimit(void);
 
 #endif
 /* Based on the answer at https://stackoverflow.com/questions/28027937/cross-platform-sockets */